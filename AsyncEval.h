@@ -0,0 +1,182 @@
+//===- AsyncEval.h - Top-level expressions on executor threads --*- C++ -*-===//
+//
+// With -async-workers, each top-level expression is compiled under a symbol
+// of its own and handed to an Executor as a Job, so the driver can read and
+// compile the input that follows while it runs. A Job is the handle: it can
+// be polled, waited for and cancelled.
+//
+// Cancellation is cooperative. Compiled code checks for it on entering a
+// reduction, which is where the language's loops and its only conditional
+// are, so a cancelled job stops recursing and skips the loops it has not
+// started yet. The check is a load of mylang.cancel.pending, nonzero only
+// while some running job is being cancelled, and on that rare path a call
+// to mylang.cancel.check, which asks whether it is the calling thread's
+// job. The JIT links both in as absolute symbols. par(...) tasks run with
+// the flag of the job that forked them, see ParRuntime.h.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_ASYNCEVAL_H
+#define MYLANG_ASYNCEVAL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace async_eval {
+
+/// Running jobs with a cancellation request; read by compiled code.
+inline std::atomic<uint32_t> &cancelsPending() {
+  static std::atomic<uint32_t> N{0};
+  return N;
+}
+
+/// The cancellation flag of the job the calling thread works for, if any.
+inline const std::atomic<bool> *&currentCancelFlag() {
+  static thread_local const std::atomic<bool> *Flag = nullptr;
+  return Flag;
+}
+
+// The entry point compiled code calls once cancelsPending() is nonzero.
+inline int32_t cancelCheck() {
+  const std::atomic<bool> *Flag = currentCancelFlag();
+  return Flag && Flag->load(std::memory_order_relaxed);
+}
+
+class Job {
+public:
+  enum Status { Queued, Running, Done, Cancelled };
+
+  explicit Job(std::function<double()> Fn) : Fn(std::move(Fn)) {}
+
+  Status status() const { return State; }
+
+  /// Done or cancelled, with nothing left running.
+  bool finished() const {
+    Status S = State;
+    return S == Done || S == Cancelled;
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> Lock(M);
+    CV.wait(Lock, [&] { return finished(); });
+  }
+
+  /// The value, once status() is Done.
+  double result() const { return Result; }
+
+  /// Ask the job to stop. A queued job never runs; a running one stops at
+  /// its next check and ends up Cancelled. False if it had finished.
+  bool cancel() {
+    std::lock_guard<std::mutex> Lock(M);
+    if (finished() || CancelFlag)
+      return false;
+    CancelFlag = true;
+    if (State == Queued)
+      finish(Cancelled);
+    else
+      ++cancelsPending();
+    return true;
+  }
+
+private:
+  friend class Executor;
+
+  std::function<double()> Fn;
+  std::atomic<Status> State{Queued};
+  std::atomic<bool> CancelFlag{false};
+  double Result = 0;
+  std::mutex M;
+  std::condition_variable CV;
+
+  // Called with M held.
+  void finish(Status S) {
+    State = S;
+    CV.notify_all();
+  }
+
+  void run() {
+    {
+      std::lock_guard<std::mutex> Lock(M);
+      if (State != Queued)
+        return;
+      State = Running;
+    }
+    currentCancelFlag() = &CancelFlag;
+    double R = Fn();
+    currentCancelFlag() = nullptr;
+    std::lock_guard<std::mutex> Lock(M);
+    Result = R;
+    if (CancelFlag)
+      --cancelsPending();
+    finish(CancelFlag ? Cancelled : Done);
+  }
+};
+
+/// Runs jobs in submission order on a fixed set of threads.
+class Executor {
+  std::mutex M;
+  std::condition_variable CV;
+  std::deque<std::shared_ptr<Job>> Queue;
+  std::vector<std::thread> Threads;
+  bool Stopping = false;
+
+public:
+  /// ThreadInit and ThreadExit, if given, run on each executor thread.
+  Executor(unsigned NumThreads, std::function<void()> ThreadInit = nullptr,
+           std::function<void()> ThreadExit = nullptr) {
+    for (unsigned I = 0; I < NumThreads; ++I)
+      Threads.emplace_back([this, ThreadInit, ThreadExit] {
+        if (ThreadInit)
+          ThreadInit();
+        while (true) {
+          std::shared_ptr<Job> J;
+          {
+            std::unique_lock<std::mutex> Lock(M);
+            CV.wait(Lock, [&] { return Stopping || !Queue.empty(); });
+            if (Queue.empty())
+              break;
+            J = std::move(Queue.front());
+            Queue.pop_front();
+          }
+          J->run();
+        }
+        if (ThreadExit)
+          ThreadExit();
+      });
+  }
+
+  /// Cancels what is still queued and waits for the running jobs.
+  ~Executor() {
+    {
+      std::lock_guard<std::mutex> Lock(M);
+      Stopping = true;
+      for (auto &J : Queue)
+        J->cancel();
+      Queue.clear();
+    }
+    CV.notify_all();
+    for (auto &T : Threads)
+      T.join();
+  }
+
+  std::shared_ptr<Job> submit(std::function<double()> Fn) {
+    auto J = std::make_shared<Job>(std::move(Fn));
+    {
+      std::lock_guard<std::mutex> Lock(M);
+      Queue.push_back(J);
+    }
+    CV.notify_one();
+    return J;
+  }
+};
+
+} // namespace async_eval
+
+#endif // MYLANG_ASYNCEVAL_H
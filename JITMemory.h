@@ -0,0 +1,503 @@
+//===- JITMemory.h - Memory accounting for the Kaleidoscope JIT -*- C++ -*-===//
+//
+// Byte accounting for the code and data the JIT links into the process.
+// Every object gets its own AccountingMemoryManager, which counts what
+// RuntimeDyld allocates from it; JITMemoryAccounting listens for objects
+// being loaded and freed and keeps per-definition and per-session totals.
+//
+// SectionMemoryManager gives every object pages of its own, a few KiB for a
+// definition of a few dozen bytes. CompactMemoryManager instead packs the
+// objects of a session into a shared CodeArena.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_JITMEMORY_H
+#define MYLANG_JITMEMORY_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Alignment.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace llvm {
+namespace orc {
+
+struct JITMemoryUsage {
+  uint64_t Code = 0;
+  uint64_t ROData = 0;
+  uint64_t RWData = 0;
+
+  uint64_t total() const { return Code + ROData + RWData; }
+
+  JITMemoryUsage &operator+=(const JITMemoryUsage &Other) {
+    Code += Other.Code;
+    ROData += Other.ROData;
+    RWData += Other.RWData;
+    return *this;
+  }
+
+  JITMemoryUsage &operator-=(const JITMemoryUsage &Other) {
+    Code -= Other.Code;
+    ROData -= Other.ROData;
+    RWData -= Other.RWData;
+    return *this;
+  }
+};
+
+/// SectionMemoryManager that counts the section bytes handed to RuntimeDyld
+/// (stubs and GOT entries included, page rounding excluded).
+class AccountingMemoryManager : public SectionMemoryManager {
+protected:
+  JITMemoryUsage Usage;
+
+public:
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    Usage.Code += Size;
+    return SectionMemoryManager::allocateCodeSection(Size, Alignment,
+                                                     SectionID, SectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    if (IsReadOnly)
+      Usage.ROData += Size;
+    else
+      Usage.RWData += Size;
+    return SectionMemoryManager::allocateDataSection(
+        Size, Alignment, SectionID, SectionName, IsReadOnly);
+  }
+
+  const JITMemoryUsage &getUsage() const { return Usage; }
+};
+
+/// Memory for many small objects, packed together rather than page by page.
+/// The arena is one contiguous region reserved up front, plus overflow
+/// chunks should it fill up. Each is a shared memory object mapped twice,
+/// back to back: a read-write view that RuntimeDyld writes through and a
+/// read-execute view that the code runs from. Code is never writable and
+/// executable at once, yet objects can share pages, and everything in the
+/// region is within 2 GiB of everything else, as the small code model needs.
+///
+/// The start of the region can be set aside as a hot zone for the code that
+/// runs most, so it shares as few pages (and iTLB entries) as possible. The
+/// region is 2 MiB aligned and the hot zone asks for transparent huge pages,
+/// which the kernel grants for shared memory only if shmem_enabled allows.
+class CodeArena {
+public:
+  enum Zone { Cold, Hot };
+
+  struct Block {
+    uint8_t *RW = nullptr;
+    uint8_t *RX = nullptr;
+    size_t Size = 0;
+  };
+
+private:
+  struct Chunk {
+    uint8_t *RW, *RX;
+    size_t Size;
+    size_t HotEnd;                 // [0, HotEnd) is the hot zone
+    std::map<size_t, size_t> Free; // offset -> size, coalesced
+  };
+
+  static constexpr size_t HugePageSize = 2 << 20;
+
+  std::mutex M;
+  std::vector<Chunk> Chunks;
+  size_t RegionSize, HotSize, ChunkSize = 1 << 20;
+  uint64_t InUse = 0, HotInUse = 0;
+
+  bool addChunk(size_t Size, size_t HotEnd) {
+#ifdef __linux__
+    Size = alignTo(Size, sys::Process::getPageSizeEstimate());
+    int FD = memfd_create("mylang-jit-code", MFD_CLOEXEC);
+    if (FD < 0)
+      return false;
+    if (ftruncate(FD, Size)) {
+      close(FD);
+      return false;
+    }
+    // Reserve room for both views, aligned for huge pages, then map them
+    // over the reservation.
+    size_t Reserved = 2 * Size + HugePageSize;
+    void *Base = mmap(nullptr, Reserved, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Base == MAP_FAILED) {
+      close(FD);
+      return false;
+    }
+    auto *Start = static_cast<uint8_t *>(Base);
+    auto *RX = reinterpret_cast<uint8_t *>(
+        alignTo(reinterpret_cast<uintptr_t>(Start), HugePageSize));
+    if (RX > Start)
+      munmap(Start, RX - Start);
+    if (Start + Reserved > RX + 2 * Size)
+      munmap(RX + 2 * Size, Start + Reserved - (RX + 2 * Size));
+    bool Ok = mmap(RX, Size, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED,
+                   FD, 0) != MAP_FAILED &&
+              mmap(RX + Size, Size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, FD, 0) != MAP_FAILED;
+    close(FD);
+    if (!Ok) {
+      munmap(RX, 2 * Size);
+      return false;
+    }
+    if (HotEnd) {
+      madvise(RX, HotEnd, MADV_HUGEPAGE);
+      madvise(RX + Size, HotEnd, MADV_HUGEPAGE);
+    }
+    Chunks.push_back({RX + Size, RX, Size, HotEnd, {{0, Size}}});
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // First fit within the zone.
+  bool allocateIn(Chunk &C, size_t Size, Align Alignment, Zone Z, Block &B) {
+    for (auto I = C.Free.begin(); I != C.Free.end(); ++I) {
+      size_t End = I->first + I->second;
+      size_t Start = alignTo(Z == Hot ? I->first
+                                      : std::max(I->first, C.HotEnd),
+                             Alignment);
+      if (Start + Size > (Z == Hot ? std::min(End, C.HotEnd) : End))
+        continue;
+      size_t Begin = I->first;
+      C.Free.erase(I);
+      if (Start > Begin)
+        C.Free[Begin] = Start - Begin;
+      if (Start + Size < End)
+        C.Free[Start + Size] = End - Start - Size;
+      InUse += Size;
+      if (Start < C.HotEnd)
+        HotInUse += Size;
+      B = {C.RW + Start, C.RX + Start, Size};
+      return true;
+    }
+    return false;
+  }
+
+public:
+  explicit CodeArena(size_t RegionSize = 64 << 20, size_t HotSize = 0)
+      : RegionSize(RegionSize), HotSize(std::min(HotSize, RegionSize)) {}
+
+  ~CodeArena() {
+#ifdef __linux__
+    for (auto &C : Chunks)
+      munmap(C.RX, 2 * C.Size);
+#endif
+  }
+
+  CodeArena(const CodeArena &) = delete;
+  CodeArena &operator=(const CodeArena &) = delete;
+
+  /// Map the region. False where the platform lacks what this needs.
+  bool init() {
+    std::lock_guard<std::mutex> Lock(M);
+    return !Chunks.empty() || addChunk(RegionSize, HotSize);
+  }
+
+  /// First fit, so freed space is reused before new chunks are mapped.
+  /// Hot allocations go to the cold zone once the hot zone is full.
+  Block allocate(size_t Size, Align Alignment, Zone Z = Cold) {
+    std::lock_guard<std::mutex> Lock(M);
+    Block B;
+    if (Z == Hot)
+      for (auto &C : Chunks)
+        if (allocateIn(C, Size, Alignment, Hot, B))
+          return B;
+    for (unsigned Attempt = 0; Attempt < 2; ++Attempt) {
+      for (auto &C : Chunks)
+        if (allocateIn(C, Size, Alignment, Cold, B))
+          return B;
+      if (!addChunk(std::max(ChunkSize, Size + Alignment.value()), 0))
+        break;
+    }
+    report_fatal_error("JIT code arena: out of memory");
+  }
+
+  void release(const Block &B) {
+    if (!B.Size)
+      return;
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &C : Chunks) {
+      if (B.RX < C.RX || B.RX >= C.RX + C.Size)
+        continue;
+      size_t Start = B.RX - C.RX, Size = B.Size;
+      if (Start < C.HotEnd)
+        HotInUse -= B.Size;
+      auto Next = C.Free.lower_bound(Start);
+      if (Next != C.Free.end() && Start + Size == Next->first) {
+        Size += Next->second;
+        Next = C.Free.erase(Next);
+      }
+      if (Next != C.Free.begin()) {
+        auto Prev = std::prev(Next);
+        if (Prev->first + Prev->second == Start) {
+          Prev->second += Size;
+          break;
+        }
+      }
+      C.Free[Start] = Size;
+      break;
+    }
+    InUse -= B.Size;
+  }
+
+  /// Whether \p Addr is in the hot zone.
+  bool isHot(const void *Addr) {
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &C : Chunks)
+      if (Addr >= C.RX && Addr < C.RX + C.HotEnd)
+        return true;
+    return false;
+  }
+
+  /// Bytes handed out, overall and in the hot zone, and bytes reserved
+  /// (each counted once, not per view).
+  uint64_t getInUse() {
+    std::lock_guard<std::mutex> Lock(M);
+    return InUse;
+  }
+  uint64_t getHotInUse() {
+    std::lock_guard<std::mutex> Lock(M);
+    return HotInUse;
+  }
+  uint64_t getHotSize() const { return HotSize; }
+  uint64_t getMapped() {
+    std::lock_guard<std::mutex> Lock(M);
+    uint64_t N = 0;
+    for (auto &C : Chunks)
+      N += C.Size;
+    return N;
+  }
+
+  /// The kernel's transparent huge page mode for shared memory, which is
+  /// what the hot zone gets.
+  static std::string getHugePageMode() {
+    std::string Mode = "unavailable";
+#ifdef __linux__
+    if (FILE *F = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled",
+                        "r")) {
+      char Buf[128] = {0};
+      if (fgets(Buf, sizeof(Buf), F)) {
+        StringRef Line(Buf);
+        size_t Open = Line.find('['), Close = Line.find(']');
+        if (Open != StringRef::npos && Close > Open)
+          Mode = Line.slice(Open + 1, Close).str();
+      }
+      fclose(F);
+    }
+#endif
+    return Mode;
+  }
+};
+
+/// Allocates an object's sections from one CodeArena block. Code and
+/// read-only data are written through the arena's read-write view and
+/// relocated for its read-execute view; writable data stays in the
+/// read-write view.
+class CompactMemoryManager : public AccountingMemoryManager {
+  CodeArena &Arena;
+  CodeArena::Zone Zone;
+  CodeArena::Block B;                  // what was reserved
+  std::vector<CodeArena::Block> Extra; // sections allocated beyond that
+  size_t CodeEnd = 0, ROEnd = 0, RWEnd = 0; // regions of B
+  size_t CodeNext = 0, RONext = 0, RWNext = 0;
+  std::vector<std::pair<uint8_t *, uint8_t *>> Mapped; // RW -> RX
+  std::vector<CodeArena::Block> Code;
+
+  // A section's block in the reserved region, or in a block of its own.
+  // Sections RuntimeDyld did not reserve space for (the GOT) end up in
+  // the latter; the arena places it near the others in practice.
+  CodeArena::Block take(size_t &Next, size_t End, uintptr_t Size,
+                        unsigned Alignment) {
+    Align A(std::max(1u, Alignment));
+    size_t Start =
+        alignTo(reinterpret_cast<uintptr_t>(B.RX) + Next, A) -
+        reinterpret_cast<uintptr_t>(B.RX);
+    if (B.Size && Start + Size <= End) {
+      Next = Start + Size;
+      return {B.RW + Start, B.RX + Start, Size};
+    }
+    Extra.push_back(Arena.allocate(std::max<uintptr_t>(Size, 1), A, Zone));
+    return Extra.back();
+  }
+
+public:
+  CompactMemoryManager(CodeArena &Arena, CodeArena::Zone Zone)
+      : Arena(Arena), Zone(Zone) {}
+  ~CompactMemoryManager() override {
+    Arena.release(B);
+    for (auto &E : Extra)
+      Arena.release(E);
+  }
+
+  bool needsToReserveAllocationSpace() override { return true; }
+
+  void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                              uintptr_t RODataSize, uint32_t RODataAlign,
+                              uintptr_t RWDataSize,
+                              uint32_t RWDataAlign) override {
+    // Slack for aligning each region's start; the sizes already include
+    // the padding between sections.
+    CodeEnd = CodeSize + CodeAlign;
+    ROEnd = CodeEnd + RODataSize + RODataAlign;
+    RWEnd = ROEnd + RWDataSize + RWDataAlign;
+    B = Arena.allocate(
+        RWEnd, Align(std::max({16u, CodeAlign, RODataAlign, RWDataAlign})),
+        Zone);
+    CodeNext = 0;
+    RONext = CodeEnd;
+    RWNext = ROEnd;
+  }
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               StringRef SectionName) override {
+    Usage.Code += Size;
+    CodeArena::Block S = take(CodeNext, CodeEnd, Size, Alignment);
+    Mapped.push_back({S.RW, S.RX});
+    Code.push_back(S);
+    return S.RW;
+  }
+
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, StringRef SectionName,
+                               bool IsReadOnly) override {
+    if (!IsReadOnly) {
+      Usage.RWData += Size;
+      return take(RWNext, RWEnd, Size, Alignment).RW;
+    }
+    Usage.ROData += Size;
+    CodeArena::Block S = take(RONext, ROEnd, Size, Alignment);
+    Mapped.push_back({S.RW, S.RX});
+    return S.RW;
+  }
+
+  void notifyObjectLoaded(RuntimeDyld &RTDyld,
+                          const object::ObjectFile &Obj) override {
+    for (auto &P : Mapped)
+      RTDyld.mapSectionAddress(P.first, reinterpret_cast<uint64_t>(P.second));
+  }
+
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override {
+    for (auto &S : Code)
+      sys::Memory::InvalidateInstructionCache(S.RX, S.Size);
+    return false;
+  }
+};
+
+/// Tracks the memory of every linked object, keyed by the memory manager
+/// that owns it. Objects are named after the symbols they define, which for
+/// this front end is the one function of each definition module.
+class JITMemoryAccounting : public JITEventListener {
+public:
+  struct ObjectUsage {
+    std::string Name;
+    JITMemoryUsage Mem;
+  };
+
+private:
+  mutable std::mutex M;
+  std::map<ObjectKey, ObjectUsage> Objects;
+  JITMemoryUsage Session;
+  uint64_t SoftLimit = 0, HardLimit = 0; // 0 means unlimited
+
+public:
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &) override {
+    ObjectUsage U;
+    for (auto &Sym : Obj.symbols()) {
+      auto Flags = Sym.getFlags();
+      if (!Flags || !(*Flags & object::SymbolRef::SF_Global) ||
+          (*Flags & object::SymbolRef::SF_Undefined))
+        continue;
+      if (auto Name = Sym.getName()) {
+        if (!U.Name.empty())
+          U.Name += ",";
+        U.Name += Name->str();
+      } else
+        consumeError(Name.takeError());
+    }
+    // The key is the address of the object's memory manager, which the
+    // linking layer always obtains from our factory.
+    U.Mem = reinterpret_cast<AccountingMemoryManager *>(K)->getUsage();
+
+    std::lock_guard<std::mutex> Lock(M);
+    Session += U.Mem;
+    Objects[K] = std::move(U);
+  }
+
+  void notifyFreeingObject(ObjectKey K) override {
+    std::lock_guard<std::mutex> Lock(M);
+    auto I = Objects.find(K);
+    if (I == Objects.end())
+      return;
+    Session -= I->second.Mem;
+    Objects.erase(I);
+  }
+
+  JITMemoryUsage getSessionUsage() const {
+    std::lock_guard<std::mutex> Lock(M);
+    return Session;
+  }
+
+  /// Usage of the live object defining \p Name, if any.
+  bool getDefinitionUsage(StringRef Name, JITMemoryUsage &Result) const {
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &KV : Objects)
+      if (KV.second.Name == Name) {
+        Result = KV.second.Mem;
+        return true;
+      }
+    return false;
+  }
+
+  void forEachObject(function_ref<void(const ObjectUsage &)> F) const {
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &KV : Objects)
+      F(KV.second);
+  }
+
+  void setLimits(uint64_t Soft, uint64_t Hard) {
+    std::lock_guard<std::mutex> Lock(M);
+    SoftLimit = Soft;
+    HardLimit = Hard;
+  }
+
+  bool overSoftLimit() const {
+    std::lock_guard<std::mutex> Lock(M);
+    return SoftLimit && Session.total() >= SoftLimit;
+  }
+
+  bool overHardLimit() const {
+    std::lock_guard<std::mutex> Lock(M);
+    return HardLimit && Session.total() >= HardLimit;
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // MYLANG_JITMEMORY_H
@@ -13,87 +13,881 @@
 #ifndef LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 #define LLVM_EXECUTIONENGINE_ORC_KALEIDOSCOPEJIT_H
 
+#include "JITMemory.h"
+#include "ParRuntime.h"
+#include "PhaseStats.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 namespace llvm {
 namespace orc {
 
+/// A function definition compiled under its own ResourceTracker. Callers
+/// reach it through an indirect stub named after the function, so its body
+/// (defined as "<name>.impl") can be evicted, recompiled or replaced without
+/// touching them.
+struct JITDefinition {
+  std::string Name;
+  std::string Body;             // symbol of the body its stub resolves to
+  uint64_t Fingerprint = 0;     // of a shared body, 0 if not shared
+  bool Merged = false;          // shares a body another definition added
+  bool Hot = false;             // placed in the arena's hot zone
+  uint64_t CallsAtLayout = 0;
+  std::atomic<bool> Speculated{false}; // compiled ahead, not called yet
+  ResourceTrackerSP RT;
+  SmallVector<char, 0> Bitcode; // retained IR, when eviction is enabled
+  uint64_t Calls = 0;           // bumped by the function's own prologue
+  uint64_t CallsAtLastScan = 0;
+  bool Compiled = false;
+  unsigned Evictions = 0;
+};
+
+/// Adds a "compile" span per module to time traces, named after the
+/// function the module defines, and counts it as compile time. Lets the
+/// JIT see every module it compiles, too.
+class TracingIRCompiler : public IRCompileLayer::IRCompiler {
+  std::unique_ptr<IRCompiler> Compile;
+  std::function<void(Module &)> OnCompile;
+
+public:
+  TracingIRCompiler(std::unique_ptr<IRCompiler> Compile,
+                    std::function<void(Module &)> OnCompile = nullptr)
+      : IRCompiler(Compile->getManglingOptions()),
+        Compile(std::move(Compile)), OnCompile(std::move(OnCompile)) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    TimeTraceScope Scope("compile", [&] {
+      for (auto &F : M)
+        if (!F.isDeclaration())
+          return F.getName().str();
+      return std::string();
+    });
+    phase_stats::CompileTimer Timer;
+    if (OnCompile)
+      OnCompile(M);
+    return (*Compile)(M);
+  }
+};
+
+/// Adds a "link" span per object to time traces, named after the symbols
+/// the object defines, and counts linking as compile time. Also decides
+/// which CodeArena zone each object goes to: RuntimeDyld allocates while
+/// emit runs, so the memory manager reads the zone on the same thread.
+class TracingObjectLinkingLayer : public RTDyldObjectLinkingLayer {
+  std::function<CodeArena::Zone(const SymbolFlagsMap &)> Placement;
+
+public:
+  using RTDyldObjectLinkingLayer::RTDyldObjectLinkingLayer;
+
+  void setPlacement(
+      std::function<CodeArena::Zone(const SymbolFlagsMap &)> Placement) {
+    this->Placement = std::move(Placement);
+  }
+
+  /// The zone of the object being emitted on this thread.
+  static CodeArena::Zone &currentZone() {
+    static thread_local CodeArena::Zone Z = CodeArena::Cold;
+    return Z;
+  }
+
+  void emit(std::unique_ptr<MaterializationResponsibility> R,
+            std::unique_ptr<MemoryBuffer> O) override {
+    TimeTraceScope Scope("link", [&] {
+      std::string Names;
+      for (auto &KV : R->getSymbols())
+        Names += (Names.empty() ? "" : ",") + (*KV.first).str();
+      return Names;
+    });
+    phase_stats::CompileTimer Timer;
+    // Emitting one object can emit others (the code it calls) first.
+    CodeArena::Zone Saved = currentZone();
+    currentZone() = Placement ? Placement(R->getSymbols()) : CodeArena::Cold;
+    RTDyldObjectLinkingLayer::emit(std::move(R), std::move(O));
+    currentZone() = Saved;
+  }
+};
+
 class KaleidoscopeJIT {
 private:
   std::unique_ptr<ExecutionSession> ES;
 
   DataLayout DL;
   MangleAndInterner Mangle;
+  JITTargetMachineBuilder TMBuilder;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
+  // With compact code, where objects are linked; must outlive them.
+  std::unique_ptr<CodeArena> Arena;
+  TracingObjectLinkingLayer ObjectLayer;
   IRCompileLayer CompileLayer;
 
   JITDylib &MainJD;
 
+  std::unique_ptr<LazyCallThroughManager> LCTM;
+  std::unique_ptr<IndirectStubsManager> ISM;
+  std::map<std::string, std::unique_ptr<JITDefinition>> Definitions;
+  std::recursive_mutex DefinitionsMutex;
+  uint64_t CodeBudget = 0; // 0 means never evict
+  unsigned EvictionCount = 0, RecompileCount = 0;
+
+  // Bodies added with a fingerprint, by fingerprint, so a definition whose
+  // optimized IR is identical to a live body shares it instead of adding
+  // another copy. Compact code only.
+  struct SharedBody {
+    std::string Symbol;
+    ResourceTrackerSP RT;
+    unsigned Users = 0;
+  };
+  std::map<uint64_t, SharedBody> SharedBodies;
+  unsigned BodySuffix = 0, MergedCount = 0;
+
+  // Hot/cold layout: definitions called at least HotCalls times between
+  // two layout passes are recompiled into the arena's hot zone.
+  uint64_t HotCalls = 0; // 0 means no layout
+  std::mutex PlacementMutex;
+  DenseSet<SymbolStringPtr> HotBodies;
+
+public:
+  struct SpeculationStats {
+    unsigned Queued = 0;   // callees queued
+    unsigned Compiled = 0; // bodies compiled ahead of their first call
+    unsigned Hits = 0;     // ...whose first call found them ready
+    unsigned Late = 0;     // ...first called while still compiling
+    unsigned Wasted = 0;   // ...replaced or evicted without being called
+    unsigned Pending = 0;  // ...not called yet
+  };
+
+private:
+  // Speculation: when a module is compiled, the definitions it calls are
+  // queued, up to SpeculateDepth calls away from code compiled on demand,
+  // and compiled by background threads before they are first called.
+  unsigned SpeculateDepth = 0;
+  std::mutex SpecMutex;
+  std::condition_variable SpecCV;
+  std::deque<std::pair<std::string, unsigned>> SpecQueue; // name, depth
+  std::set<std::string> SpecQueued;
+  std::vector<std::thread> SpecThreads;
+  bool SpecStopping = false;
+  std::atomic<unsigned> SpecCompiled{0}, SpecHits{0}, SpecLate{0},
+      SpecWasted{0};
+  unsigned SpecQueuedCount = 0;
+
+  // How far from code compiled on demand the module being compiled on
+  // this thread is, and whether the worker's lookup compiled anything.
+  static unsigned &speculationDepth() {
+    static thread_local unsigned Depth = 0;
+    return Depth;
+  }
+  static bool &compiledHere() {
+    static thread_local bool Compiled = false;
+    return Compiled;
+  }
+
+  void queueCallees(Module &M) {
+    compiledHere() = true;
+    unsigned Depth = speculationDepth() + 1;
+    if (Depth > SpeculateDepth)
+      return;
+    std::lock_guard<std::mutex> Lock(SpecMutex);
+    for (auto &F : M) {
+      if (!F.isDeclaration() || F.isIntrinsic())
+        continue;
+      bool Called = llvm::any_of(F.users(), [&](User *U) {
+        auto *CI = dyn_cast<CallInst>(U);
+        return CI && CI->getCalledFunction() == &F;
+      });
+      if (Called && SpecQueued.insert(F.getName().str()).second) {
+        SpecQueue.push_back({F.getName().str(), Depth});
+        ++SpecQueuedCount;
+      }
+    }
+    SpecCV.notify_one();
+  }
+
+  void speculate() {
+    while (true) {
+      std::pair<std::string, unsigned> Next;
+      {
+        std::unique_lock<std::mutex> Lock(SpecMutex);
+        SpecCV.wait(Lock, [&] { return SpecStopping || !SpecQueue.empty(); });
+        if (SpecStopping)
+          return;
+        Next = SpecQueue.front();
+        SpecQueue.pop_front();
+        SpecQueued.erase(Next.first);
+      }
+
+      // Externs and bodies that are already running need nothing.
+      std::string Body;
+      {
+        std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+        auto I = Definitions.find(Next.first);
+        if (I == Definitions.end() || !I->second->RT ||
+            I->second->Compiled || I->second->Speculated)
+          continue;
+        Body = I->second->Body;
+      }
+
+      speculationDepth() = Next.second;
+      compiledHere() = false;
+      auto Sym = ES->lookup({&MainJD}, Mangle(Body));
+      speculationDepth() = 0;
+      if (!Sym) {
+        // Replaced or removed meanwhile.
+        consumeError(Sym.takeError());
+        continue;
+      }
+      if (!compiledHere())
+        continue; // compiled already, or by another thread
+
+      ++SpecCompiled;
+      std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+      auto I = Definitions.find(Next.first);
+      if (I == Definitions.end() || I->second->Body != Body)
+        ++SpecWasted;
+      else if (I->second->Compiled)
+        ++SpecLate;
+      else
+        I->second->Speculated = true;
+    }
+  }
+
+  void stopSpeculation() {
+    {
+      std::lock_guard<std::mutex> Lock(SpecMutex);
+      SpecStopping = true;
+    }
+    SpecCV.notify_all();
+    for (auto &T : SpecThreads)
+      T.join();
+    SpecThreads.clear();
+  }
+
+  // A body compiled ahead that is going away was never called.
+  void dropSpeculated(JITDefinition &Def) {
+    if (Def.Speculated.exchange(false))
+      ++SpecWasted;
+  }
+
+  JITMemoryAccounting MemAccounting;
+  std::function<void()> OnSoftLimit;
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
+  // Point Def's stub at a fresh lazy call-through trampoline, so the next
+  // call compiles whatever body is currently registered for it.
+  Error resetStub(JITDefinition &Def) {
+    JITDefinition *D = &Def;
+    auto Trampoline = LCTM->getCallThroughTrampoline(
+        MainJD, Mangle(Def.Body),
+        [this, D](JITTargetAddress BodyAddr) -> Error {
+          if (D->Evictions)
+            ++RecompileCount;
+          if (D->Speculated.exchange(false))
+            ++SpecHits;
+          D->Compiled = true;
+          return ISM->updatePointer(D->Name, BodyAddr);
+        });
+    if (!Trampoline)
+      return Trampoline.takeError();
+    Def.Compiled = false;
+    return ISM->updatePointer(Def.Name, *Trampoline);
+  }
+
+  Error addBody(JITDefinition &Def, ThreadSafeModule TSM) {
+    Def.RT = MainJD.createResourceTracker();
+    return CompileLayer.add(Def.RT, std::move(TSM));
+  }
+
+  JITDefinition &getDefinition(StringRef Name) {
+    auto &Slot = Definitions[Name.str()];
+    if (!Slot) {
+      Slot = std::make_unique<JITDefinition>();
+      Slot->Name = Name.str();
+      Slot->Body = getBodyName(Name);
+    }
+    return *Slot;
+  }
+
+  // Drop Def's current body, unless other definitions still share it.
+  Error releaseBody(JITDefinition &Def) {
+    if (!Def.RT)
+      return Error::success();
+    dropSpeculated(Def);
+    ResourceTrackerSP RT = std::move(Def.RT);
+    Def.Merged = false;
+    if (Def.Fingerprint) {
+      auto I = SharedBodies.find(Def.Fingerprint);
+      Def.Fingerprint = 0;
+      if (--I->second.Users)
+        return Error::success();
+      SharedBodies.erase(I);
+    }
+    return RT->remove();
+  }
+
+  // A body symbol for Name that no shared body still holds.
+  std::string newBodySymbol(StringRef Name) {
+    std::string Symbol = getBodyName(Name);
+    for (auto &KV : SharedBodies)
+      if (KV.second.Symbol == Symbol)
+        return Symbol + "." + std::to_string(++BodySuffix);
+    return Symbol;
+  }
+
+  // Route calls to Def's newly added body, creating its stub and public
+  // symbol the first time.
+  Error publish(JITDefinition &Def, bool IsNew) {
+    if (IsNew) {
+      if (auto Err = ISM->createStub(Def.Name, 0, JITSymbolFlags::Exported |
+                                                     JITSymbolFlags::Callable))
+        return Err;
+      if (auto Err = resetStub(Def))
+        return Err;
+      return MainJD.define(absoluteSymbols(
+          {{Mangle(Def.Name), ISM->findStub(Def.Name, false)}}));
+    }
+    return resetStub(Def);
+  }
+
+  void setPlacement(JITDefinition &Def, bool Hot) {
+    std::lock_guard<std::mutex> Lock(PlacementMutex);
+    if (Hot)
+      HotBodies.insert(Mangle(Def.Body));
+    else
+      HotBodies.erase(Mangle(Def.Body));
+    Def.Hot = Hot;
+  }
+
+  // Recompile Def into the hot or the cold zone. Moving in fails, leaving
+  // Def cold, if the hot zone turns out to be too full for it.
+  Expected<bool> moveTo(JITDefinition &Def, bool Hot) {
+    setPlacement(Def, Hot);
+    if (auto Err = recompile(Def))
+      return std::move(Err);
+    if (!Hot)
+      return true;
+    auto Sym = ES->lookup({&MainJD}, Mangle(Def.Body));
+    if (!Sym)
+      return Sym.takeError();
+    if (Arena->isHot(jitTargetAddressToPointer<void *>(Sym->getAddress())))
+      return true;
+    setPlacement(Def, false);
+    return false;
+  }
+
+  Error checkMemoryLimits() {
+    if (MemAccounting.overSoftLimit()) {
+      if (OnSoftLimit)
+        OnSoftLimit();
+      else
+        errs() << "warning: JIT memory over soft limit ("
+               << MemAccounting.getSessionUsage().total() << " bytes)\n";
+    }
+    if (MemAccounting.overHardLimit())
+      return make_error<StringError>(
+          "JIT memory hard limit reached (" +
+              Twine(MemAccounting.getSessionUsage().total()) + " bytes)",
+          inconvertibleErrorCode());
+    return Error::success();
+  }
+
+  // Call counts and retained IR serve eviction and hot/cold layout.
+  bool countsCalls() const { return CodeBudget || HotCalls; }
+
+  // Drop Def's machine code and re-register its retained IR, to be
+  // compiled again on the next call. Only safe while no JIT'd code runs.
+  Error evict(JITDefinition &Def) {
+    if (auto Err = recompile(Def))
+      return Err;
+    ++EvictionCount;
+    return Error::success();
+  }
+
+  Error recompile(JITDefinition &Def) {
+    dropSpeculated(Def);
+    if (auto Err = Def.RT->remove())
+      return Err;
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Def.Bitcode.data(), Def.Bitcode.size()),
+                        Def.Name),
+        *Ctx);
+    if (!M)
+      return M.takeError();
+    if (auto Err = addBody(Def, ThreadSafeModule(std::move(*M),
+                                                 std::move(Ctx))))
+      return Err;
+    ++Def.Evictions;
+    return resetStub(Def);
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  std::unique_ptr<LazyCallThroughManager> LCTM,
+                  std::unique_ptr<IndirectStubsManager> ISM,
+                  std::unique_ptr<CodeArena> Arena = nullptr)
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        TMBuilder(JTMB), Arena(std::move(Arena)),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    [this]() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
+                      if (this->Arena)
+                        return std::make_unique<CompactMemoryManager>(
+                            *this->Arena,
+                            TracingObjectLinkingLayer::currentZone());
+                      return std::make_unique<AccountingMemoryManager>();
+                    }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                     std::make_unique<TracingIRCompiler>(
+                         std::make_unique<ConcurrentIRCompiler>(
+                             std::move(JTMB)),
+                         [this](Module &M) {
+                           if (SpeculateDepth)
+                             queueCallees(M);
+                         })),
+        MainJD(this->ES->createBareJITDylib("<main>")), LCTM(std::move(LCTM)),
+        ISM(std::move(ISM)) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
             DL.getGlobalPrefix())));
-    if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+    // The runtime compiled code calls into, see ParRuntime.h and
+    // AsyncEval.h.
+    cantFail(MainJD.define(absoluteSymbols(
+        {{Mangle("mylang.par.fork"),
+          JITEvaluatedSymbol(
+              pointerToJITTargetAddress(&par_runtime::shouldFork),
+              JITSymbolFlags::Callable)},
+         {Mangle("mylang.par.run"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&par_runtime::run),
+                             JITSymbolFlags::Callable)},
+         {Mangle("mylang.cancel.pending"),
+          JITEvaluatedSymbol(
+              pointerToJITTargetAddress(&async_eval::cancelsPending()),
+              JITSymbolFlags::None)},
+         {Mangle("mylang.cancel.check"),
+          JITEvaluatedSymbol(
+              pointerToJITTargetAddress(&async_eval::cancelCheck),
+              JITSymbolFlags::Callable)}})));
+    ObjectLayer.registerJITEventListener(MemAccounting);
+    ObjectLayer.setPlacement([this](const SymbolFlagsMap &Symbols) {
+      std::lock_guard<std::mutex> Lock(PlacementMutex);
+      for (auto &KV : Symbols)
+        if (HotBodies.count(KV.first))
+          return CodeArena::Hot;
+      return CodeArena::Cold;
+    });
+    if (TMBuilder.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
   }
 
   ~KaleidoscopeJIT() {
+    stopSpeculation();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    ObjectLayer.unregisterJITEventListener(MemAccounting);
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  /// With \p CompactCode, code is packed into a CodeArena, compiled for the
+  /// small code model (shorter calls and constant loads than the large one
+  /// JITs default to, which only works because the arena keeps everything
+  /// close), and identical bodies added with a fingerprint are shared.
+  /// \p HotZone bytes of the arena are set aside for setHotLayout.
+  /// Falls back to the defaults where the arena is not supported.
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(bool CompactCode = false, uint64_t HotZone = 0) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    JITTargetMachineBuilder JTMB(
-        ES->getExecutorProcessControl().getTargetTriple());
+    // Target the host CPU so the vectorizer can use its full SIMD width.
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB)
+      return JTMB.takeError();
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    std::unique_ptr<CodeArena> Arena;
+    if (CompactCode) {
+      Arena = std::make_unique<CodeArena>(64 << 20, HotZone);
+      if (Arena->init()) {
+        // PIC, so the address of a function (a par operand, see
+        // ParRuntime.h) is RIP-relative rather than a 32-bit absolute,
+        // which the arena's addresses don't fit.
+        JTMB->setCodeModel(CodeModel::Small);
+        JTMB->setRelocationModel(Reloc::PIC_);
+      } else
+        Arena.reset();
+    }
+
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    auto LCTM = createLocalLazyCallThroughManager(
+        JTMB->getTargetTriple(), *ES,
+        pointerToJITTargetAddress(&handleLazyCallThroughError));
+    if (!LCTM)
+      return LCTM.takeError();
+
+    auto ISM = createLocalIndirectStubsManagerBuilder(JTMB->getTargetTriple())();
+
+    return std::make_unique<KaleidoscopeJIT>(
+        std::move(ES), std::move(*JTMB), std::move(*DL), std::move(*LCTM),
+        std::move(ISM), std::move(Arena));
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  /// A TargetMachine for the JIT's target, e.g. for IR-level cost models.
+  /// TargetMachines are not thread-safe, so each thread needs its own.
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return TMBuilder.createTargetMachine();
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  JITMemoryAccounting &getMemoryAccounting() { return MemAccounting; }
+
+  /// The arena compact code is linked into, or null.
+  CodeArena *getCodeArena() { return Arena.get(); }
+
+  /// Listeners see objects linked after they are registered. They must
+  /// outlive the JIT or be unregistered first.
+  void registerJITEventListener(JITEventListener &L) {
+    ObjectLayer.registerJITEventListener(L);
+  }
+  void unregisterJITEventListener(JITEventListener &L) {
+    ObjectLayer.unregisterJITEventListener(L);
+  }
+
+  /// Called when a module is added while the session is over its soft
+  /// memory limit. Without a handler a warning is printed.
+  void setSoftLimitHandler(std::function<void()> Handler) {
+    OnSoftLimit = std::move(Handler);
+  }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+    if (auto Err = checkMemoryLimits())
+      return Err;
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
     return CompileLayer.add(RT, std::move(TSM));
   }
 
+  /// Add an already compiled object file, bypassing the compile layer.
+  Error addObjectFile(std::unique_ptr<MemoryBuffer> Obj,
+                      ResourceTrackerSP RT = nullptr) {
+    if (auto Err = checkMemoryLimits())
+      return Err;
+    if (!RT)
+      RT = MainJD.getDefaultResourceTracker();
+    return ObjectLayer.add(RT, std::move(Obj));
+  }
+
+  static std::string getBodyName(StringRef Name) {
+    return (Name + ".impl").str();
+  }
+
+  /// Add the module holding function \p Name. The function gets its own
+  /// ResourceTracker behind a lazy stub; adding it again replaces the body.
+  /// With compact code, a nonzero \p Fingerprint of the function's IR lets
+  /// definitions with identical bodies share one; callers must make sure
+  /// equal fingerprints mean interchangeable code.
+  Error addDefinition(StringRef Name, ThreadSafeModule TSM,
+                      uint64_t Fingerprint = 0) {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    if (auto Err = checkMemoryLimits())
+      return Err;
+
+    JITDefinition &Def = getDefinition(Name);
+    bool IsNew = !Def.RT;
+    // Evicting or moving a shared body would pull it from under its other
+    // users, and counted bodies all differ anyway.
+    if (!Arena || countsCalls())
+      Fingerprint = 0;
+
+    auto Shared = SharedBodies.find(Fingerprint);
+    if (Fingerprint && Shared != SharedBodies.end()) {
+      if (Def.Fingerprint == Fingerprint)
+        return Error::success(); // redefined as it was
+      if (auto Err = releaseBody(Def))
+        return Err;
+      ++Shared->second.Users;
+      Def.RT = Shared->second.RT;
+      Def.Body = Shared->second.Symbol;
+      Def.Fingerprint = Fingerprint;
+      Def.Merged = true;
+      Def.Bitcode.clear();
+      ++MergedCount;
+      return publish(Def, IsNew);
+    }
+
+    if (auto Err = releaseBody(Def))
+      return Err;
+    Def.Body = Fingerprint ? newBodySymbol(Name) : getBodyName(Name);
+    TSM.withModuleDo([&](Module &M) {
+      M.getFunction(Name)->setName(Def.Body);
+      Def.Bitcode.clear();
+      if (countsCalls()) {
+        raw_svector_ostream OS(Def.Bitcode);
+        WriteBitcodeToFile(M, OS);
+      }
+    });
+
+    if (auto Err = addBody(Def, std::move(TSM)))
+      return Err;
+    if (Fingerprint) {
+      SharedBodies[Fingerprint] = {Def.Body, Def.RT, 1};
+      Def.Fingerprint = Fingerprint;
+    }
+    return publish(Def, IsNew);
+  }
+
+  /// addDefinition for a body that is compiled already: \p Obj defines
+  /// getBodyName(Name). It is linked on the first call and never evicted.
+  Error addDefinitionObject(StringRef Name, std::unique_ptr<MemoryBuffer> Obj) {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    if (auto Err = checkMemoryLimits())
+      return Err;
+
+    JITDefinition &Def = getDefinition(Name);
+    bool IsNew = !Def.RT;
+    Def.Bitcode.clear();
+    if (auto Err = releaseBody(Def))
+      return Err;
+    Def.Body = getBodyName(Name);
+    Def.RT = MainJD.createResourceTracker();
+    if (auto Err = ObjectLayer.add(Def.RT, std::move(Obj)))
+      return Err;
+    return publish(Def, IsNew);
+  }
+
+  /// Evict the machine code of the coldest definitions (fewest calls since
+  /// the previous scan) until the session's JIT memory fits \p Budget;
+  /// \p Budget 0 uses the configured code budget.
+  Error evictColdDefinitions(uint64_t Budget = 0) {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    if (!Budget)
+      Budget = CodeBudget;
+    if (!Budget || MemAccounting.getSessionUsage().total() <= Budget)
+      return Error::success();
+
+    std::vector<JITDefinition *> Candidates;
+    for (auto &KV : Definitions)
+      if (KV.second->RT && KV.second->Compiled && !KV.second->Bitcode.empty())
+        Candidates.push_back(KV.second.get());
+    std::stable_sort(Candidates.begin(), Candidates.end(),
+                     [](JITDefinition *A, JITDefinition *B) {
+                       return A->Calls - A->CallsAtLastScan <
+                              B->Calls - B->CallsAtLastScan;
+                     });
+
+    for (auto *Def : Candidates) {
+      if (MemAccounting.getSessionUsage().total() <= Budget)
+        break;
+      if (auto Err = evict(*Def))
+        return Err;
+    }
+    for (auto &KV : Definitions)
+      KV.second->CallsAtLastScan = KV.second->Calls;
+    return Error::success();
+  }
+
+  /// Evict cold code whenever the session exceeds \p Budget bytes. The
+  /// IR of every definition is retained from then on.
+  void setCodeBudget(uint64_t Budget) { CodeBudget = Budget; }
+
+  uint64_t getCodeBudget() const { return CodeBudget; }
+
+  /// Counter the prologue of \p Name should bump on every call, or null when
+  /// call counts are not needed.
+  uint64_t *getCallCounter(StringRef Name) {
+    if (!countsCalls())
+      return nullptr;
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    return &getDefinition(Name).Calls;
+  }
+
+  /// Move definitions called at least \p Calls times between two calls of
+  /// layoutHotDefinitions into the arena's hot zone; 0 disables layout.
+  void setHotLayout(uint64_t Calls) {
+    HotCalls = Arena && Arena->getHotSize() ? Calls : 0;
+  }
+
+  uint64_t getHotLayout() const { return HotCalls; }
+
+  struct LayoutChange {
+    unsigned MovedIn = 0, MovedOut = 0;
+    uint64_t Bytes = 0; // code and data moved in
+  };
+
+  /// Recompile the definitions that became hot since the last pass into
+  /// the hot zone, hottest first, and move definitions that are no longer
+  /// hot out of it when that makes room. What moves in is compiled right
+  /// away; what moves out, on its next call. Only safe while no JIT'd code
+  /// runs.
+  Expected<LayoutChange> layoutHotDefinitions() {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    LayoutChange Change;
+    if (!HotCalls)
+      return Change;
+
+    auto Size = [&](JITDefinition &Def) {
+      JITMemoryUsage U;
+      return MemAccounting.getDefinitionUsage(Def.Body, U) ? U.total() : 0;
+    };
+    std::vector<JITDefinition *> Hot, Cooled;
+    uint64_t Free = Arena->getHotSize() - Arena->getHotInUse();
+    for (auto &KV : Definitions) {
+      JITDefinition &Def = *KV.second;
+      if (!Def.RT || Def.Bitcode.empty())
+        continue;
+      uint64_t Recent = Def.Calls - Def.CallsAtLayout;
+      Def.CallsAtLayout = Def.Calls;
+      if (Recent >= HotCalls && !Def.Hot)
+        Hot.push_back(&Def);
+      else if (Recent < HotCalls && Def.Hot)
+        Cooled.push_back(&Def);
+    }
+    std::stable_sort(Hot.begin(), Hot.end(),
+                     [](JITDefinition *A, JITDefinition *B) {
+                       return A->Calls > B->Calls;
+                     });
+
+    for (auto *Def : Hot) {
+      uint64_t Needed = Size(*Def);
+      while (Needed > Free && !Cooled.empty()) {
+        JITDefinition *Out = Cooled.back();
+        Cooled.pop_back();
+        Free += Size(*Out);
+        auto Moved = moveTo(*Out, false);
+        if (!Moved)
+          return Moved.takeError();
+        ++Change.MovedOut;
+      }
+      if (Needed > Free)
+        break;
+      auto Moved = moveTo(*Def, true);
+      if (!Moved)
+        return Moved.takeError();
+      if (!*Moved)
+        break;
+      Needed = Size(*Def);
+      Free -= std::min(Free, Needed);
+      Change.Bytes += Needed;
+      ++Change.MovedIn;
+    }
+    return Change;
+  }
+
+  /// Whether Name has a body, which defining it again releases.
+  bool isDefined(StringRef Name) {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    auto I = Definitions.find(Name.str());
+    return I != Definitions.end() && I->second->RT;
+  }
+
+  bool isHot(StringRef Name) {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    auto I = Definitions.find(Name.str());
+    return I != Definitions.end() && I->second->Hot;
+  }
+
+  /// Compile the definitions that compiled code calls, up to \p Depth calls
+  /// away from code compiled on demand, on \p Threads background threads
+  /// before their first call. With \p Idle the threads only get CPU time
+  /// that would otherwise go unused (SCHED_IDLE). Call once, before adding
+  /// code.
+  void startSpeculation(unsigned Depth, unsigned Threads, bool Idle) {
+    SpeculateDepth = Depth;
+    if (!Depth)
+      return;
+    for (unsigned I = 0; I < std::max(1u, Threads); ++I)
+      SpecThreads.emplace_back([this, Idle] {
+#ifdef __linux__
+        if (Idle) {
+          sched_param Param = {};
+          pthread_setschedparam(pthread_self(), SCHED_IDLE, &Param);
+        }
+#endif
+        speculate();
+      });
+  }
+
+  SpeculationStats getSpeculationStats() {
+    SpeculationStats S;
+    {
+      std::lock_guard<std::mutex> Lock(SpecMutex);
+      S.Queued = SpecQueuedCount;
+    }
+    S.Compiled = SpecCompiled;
+    S.Hits = SpecHits;
+    S.Late = SpecLate;
+    S.Wasted = SpecWasted;
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    for (auto &KV : Definitions)
+      S.Pending += KV.second->Speculated;
+    return S;
+  }
+
+  /// Definitions that share the body of an earlier one, as (name, body).
+  std::vector<std::pair<std::string, std::string>> getMergedDefinitions() {
+    std::lock_guard<std::recursive_mutex> Lock(DefinitionsMutex);
+    std::vector<std::pair<std::string, std::string>> Result;
+    for (auto &KV : Definitions)
+      if (KV.second->Merged)
+        Result.push_back({KV.first, KV.second->Body});
+    return Result;
+  }
+
+  /// How many times a definition was added as a share of an existing body.
+  unsigned getMergedCount() const { return MergedCount; }
+
+  unsigned getEvictionCount() const { return EvictionCount; }
+  unsigned getRecompileCount() const { return RecompileCount; }
+
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+    TimeTraceScope Scope("lookup", Name);
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
 };
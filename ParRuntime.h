@@ -0,0 +1,324 @@
+//===- ParRuntime.h - Work-stealing runtime for par(...) --------*- C++ -*-===//
+//
+// par(e1, ..., en) evaluates its operands as tasks and yields their sum.
+// Codegen outlines each operand into a function double(double *Env) and
+// calls into this runtime, which the JIT links in as absolute symbols:
+//
+//   mylang.par.fork  i32 ()        nonzero if a par here should fork
+//   mylang.par.run   void (i64 N, fn *Fns, double *Env, double *Results)
+//
+// Every thread that forks owns a deque. It pushes the tasks onto it, runs
+// the first one itself and then, until the others are done, pops its own
+// deque or steals from the front of the others'. When there has been
+// nothing to take for a while it blocks on the join instead, waking up now
+// and then to look again. Pool workers do the same while idle and sleep
+// when there is nothing to steal.
+//
+// The sequential cutoff is a nesting depth: a par inside Cutoff enclosing
+// pars (counting the ones in tasks that were stolen) doesn't fork, and its
+// operands are evaluated inline. With a single worker nothing forks.
+//
+// A task runs with the depth and the cancellation flag (AsyncEval.h) of
+// the thread that forked it. Pool workers run the thread hooks, if set, on
+// starting and before exiting.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_PARRUNTIME_H
+#define MYLANG_PARRUNTIME_H
+
+#include "AsyncEval.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace par_runtime {
+
+using TaskFn = double (*)(double *Env);
+
+struct Stats {
+  uint64_t Forks, Tasks, Stolen;
+};
+
+class Scheduler {
+  // The tasks of one run() still to finish. Lives on the forking thread's
+  // stack; finishing a task takes the mutex, so the forker can't return
+  // while the last one is still signalling.
+  struct Join {
+    std::atomic<int64_t> Pending;
+    std::mutex Mutex;
+    std::condition_variable CV;
+  };
+
+  struct Task {
+    TaskFn Fn;
+    double *Env;
+    double *Result;
+    Join *J;
+    unsigned Depth;
+    const std::atomic<bool> *Cancel;
+  };
+
+  // A joining thread that found nothing to do JoinSpins times in a row
+  // blocks, looking for work again every JoinWaitUs microseconds.
+  enum : unsigned { JoinSpins = 64, JoinWaitUs = 200 };
+
+  struct Deque {
+    std::mutex Mutex;
+    std::deque<Task> Tasks;
+  };
+
+  // Fixed, so thieves can scan the deques while threads register theirs.
+  static constexpr unsigned MaxDeques = 128;
+  Deque Deques[MaxDeques];
+  std::atomic<unsigned> NumDeques{0};
+
+  unsigned Workers = 1;
+  unsigned Cutoff = 0;
+  std::atomic<bool> Running{false};
+  std::mutex PoolMutex;
+  std::vector<std::thread> Pool;
+  std::function<void()> ThreadInit, ThreadExit;
+
+  // Tasks sitting in some deque; idle workers sleep while it is zero.
+  std::atomic<int64_t> Queued{0};
+  std::atomic<unsigned> Sleepers{0};
+  std::mutex SleepMutex;
+  std::condition_variable SleepCV;
+  bool Stopping = false;
+
+  std::atomic<uint64_t> Forks{0}, TaskCount{0}, StolenCount{0};
+
+  static unsigned &depth() {
+    static thread_local unsigned D = 0;
+    return D;
+  }
+
+  // The calling thread's deque, registered on first use; null if all are
+  // taken.
+  Deque *ownDeque() {
+    static thread_local int Idx = -1;
+    if (Idx < 0) {
+      unsigned I = NumDeques++;
+      if (I >= MaxDeques)
+        return nullptr;
+      Idx = I;
+    }
+    return &Deques[Idx];
+  }
+
+  bool pop(Deque &D, Task &T) {
+    std::lock_guard<std::mutex> Lock(D.Mutex);
+    if (D.Tasks.empty())
+      return false;
+    T = D.Tasks.back();
+    D.Tasks.pop_back();
+    --Queued;
+    return true;
+  }
+
+  // Oldest tasks first: near the root of the recursion, i.e. the biggest.
+  bool steal(Deque *Own, Task &T) {
+    unsigned N = NumDeques;
+    if (N > MaxDeques)
+      N = MaxDeques;
+    static thread_local unsigned Next = 0;
+    for (unsigned K = 0; K < N; ++K) {
+      Deque &D = Deques[Next++ % N];
+      if (&D == Own)
+        continue;
+      std::unique_lock<std::mutex> Lock(D.Mutex, std::try_to_lock);
+      if (!Lock || D.Tasks.empty())
+        continue;
+      T = D.Tasks.front();
+      D.Tasks.pop_front();
+      --Queued;
+      ++StolenCount;
+      return true;
+    }
+    return false;
+  }
+
+  bool findWork(Deque *Own, Task &T) {
+    return (Own && pop(*Own, T)) || steal(Own, T);
+  }
+
+  static double runAt(unsigned Depth, const std::atomic<bool> *Cancel,
+                      TaskFn Fn, double *Env) {
+    unsigned SavedDepth = depth();
+    const std::atomic<bool> *SavedCancel = async_eval::currentCancelFlag();
+    depth() = Depth;
+    async_eval::currentCancelFlag() = Cancel;
+    double Result = Fn(Env);
+    depth() = SavedDepth;
+    async_eval::currentCancelFlag() = SavedCancel;
+    return Result;
+  }
+
+  void execute(const Task &T) {
+    *T.Result = runAt(T.Depth, T.Cancel, T.Fn, T.Env);
+    std::lock_guard<std::mutex> Lock(T.J->Mutex);
+    if (T.J->Pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      T.J->CV.notify_one();
+  }
+
+  void wake() {
+    if (!Sleepers)
+      return;
+    std::lock_guard<std::mutex> Lock(SleepMutex);
+    SleepCV.notify_all();
+  }
+
+  void work() {
+    Deque *Own = ownDeque();
+    Task T;
+    while (true) {
+      if (findWork(Own, T)) {
+        execute(T);
+        continue;
+      }
+      std::unique_lock<std::mutex> Lock(SleepMutex);
+      if (Stopping)
+        return;
+      ++Sleepers;
+      SleepCV.wait(Lock, [&] { return Stopping || Queued > 0; });
+      --Sleepers;
+    }
+  }
+
+  void start() {
+    if (Running.load(std::memory_order_acquire))
+      return;
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    if (Running)
+      return;
+    for (unsigned I = 1; I < Workers; ++I)
+      Pool.emplace_back([this] {
+        if (ThreadInit)
+          ThreadInit();
+        work();
+        if (ThreadExit)
+          ThreadExit();
+      });
+    Running = true;
+  }
+
+  void stop() {
+    std::lock_guard<std::mutex> Lock(PoolMutex);
+    {
+      std::lock_guard<std::mutex> SleepLock(SleepMutex);
+      Stopping = true;
+    }
+    SleepCV.notify_all();
+    for (auto &T : Pool)
+      T.join();
+    Pool.clear();
+    Stopping = false;
+    Running = false;
+  }
+
+public:
+  static Scheduler &get() {
+    static Scheduler S;
+    return S;
+  }
+
+  Scheduler() { configure(0, 0); }
+  ~Scheduler() { stop(); }
+
+  /// Workers counts the forking thread; 0 means one per core. Cutoff 0
+  /// picks a depth that makes about eight tasks per worker. Call only while
+  /// no par runs; a running pool is stopped and restarts on the next fork.
+  void configure(unsigned NewWorkers, unsigned NewCutoff) {
+    stop();
+    Workers = NewWorkers ? NewWorkers
+                         : std::max(1u, std::thread::hardware_concurrency());
+    Cutoff = NewCutoff;
+    if (!Cutoff) {
+      while ((1u << Cutoff) < Workers)
+        ++Cutoff;
+      Cutoff += 3;
+    }
+  }
+
+  /// Call only while no par runs, like configure().
+  void setThreadHooks(std::function<void()> Init, std::function<void()> Exit) {
+    stop();
+    ThreadInit = std::move(Init);
+    ThreadExit = std::move(Exit);
+  }
+
+  unsigned workers() const { return Workers; }
+  unsigned cutoff() const { return Cutoff; }
+
+  // Called by every par, so it stays cheap and keeps no statistics.
+  bool shouldFork() { return Workers > 1 && depth() < Cutoff; }
+
+  void run(int64_t N, TaskFn *Fns, double *Env, double *Results) {
+    start();
+    Deque *Own = ownDeque();
+    unsigned Depth = depth() + 1;
+    const std::atomic<bool> *Cancel = async_eval::currentCancelFlag();
+    ++Forks;
+    TaskCount += N;
+    if (!Own || N < 2) {
+      for (int64_t I = 0; I < N; ++I)
+        Results[I] = runAt(Depth, Cancel, Fns[I], Env);
+      return;
+    }
+
+    Join J;
+    J.Pending = N - 1;
+    {
+      // Last pushed is popped first, so the thread itself takes the
+      // operands in source order.
+      std::lock_guard<std::mutex> Lock(Own->Mutex);
+      for (int64_t I = N - 1; I >= 1; --I)
+        Own->Tasks.push_back({Fns[I], Env, &Results[I], &J, Depth, Cancel});
+    }
+    Queued += N - 1;
+    wake();
+
+    Results[0] = runAt(Depth, Cancel, Fns[0], Env);
+    auto Done = [&] { return J.Pending.load(std::memory_order_acquire) == 0; };
+    Task T;
+    unsigned Misses = 0;
+    while (!Done()) {
+      if (findWork(Own, T)) {
+        execute(T);
+        Misses = 0;
+      } else if (++Misses < JoinSpins) {
+        std::this_thread::yield();
+      } else {
+        // The rest were stolen and are running elsewhere.
+        std::unique_lock<std::mutex> Lock(J.Mutex);
+        J.CV.wait_for(Lock, std::chrono::microseconds(JoinWaitUs), Done);
+        Misses = 0;
+      }
+    }
+    // Wait for the last execute() to let go of J.
+    std::lock_guard<std::mutex> Lock(J.Mutex);
+  }
+
+  Stats stats() const {
+    return {Forks, TaskCount, StolenCount};
+  }
+};
+
+// The entry points JIT'd code calls.
+inline int32_t shouldFork() { return Scheduler::get().shouldFork(); }
+
+inline void run(int64_t N, TaskFn *Fns, double *Env, double *Results) {
+  Scheduler::get().run(N, Fns, Env, Results);
+}
+
+} // namespace par_runtime
+
+#endif // MYLANG_PARRUNTIME_H
@@ -0,0 +1,137 @@
+//===- PerfCounters.h - Hardware counters around JIT'd code -----*- C++ -*-===//
+//
+// A handful of perf_event_open counters for the calling thread, user space
+// only. Each counter is opened on its own, so the ones the kernel or the
+// (virtual) CPU won't give us are simply unavailable rather than failing
+// the whole set. Counts are scaled when the kernel multiplexed a counter.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_PERFCOUNTERS_H
+#define MYLANG_PERFCOUNTERS_H
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+class PerfCounters {
+public:
+  enum Counter {
+    Cycles,
+    Instructions,
+    BranchMisses,
+    L1DMisses,
+    LLCMisses,
+    L1IMisses,
+    ITLBMisses,
+    NumCounters
+  };
+
+  static const char *getName(Counter C) {
+    static const char *const Names[] = {"cycles", "instructions",
+                                        "branch-misses", "L1d-misses",
+                                        "LLC-misses",    "L1i-misses",
+                                        "iTLB-misses"};
+    return Names[C];
+  }
+
+  PerfCounters() {
+    for (int &FD : FDs)
+      FD = -1;
+#ifdef __linux__
+    auto Cache = [](uint64_t Cache) {
+      return Cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    };
+    const struct {
+      uint32_t Type;
+      uint64_t Config;
+    } Events[NumCounters] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, Cache(PERF_COUNT_HW_CACHE_L1D)},
+        {PERF_TYPE_HW_CACHE, Cache(PERF_COUNT_HW_CACHE_LL)},
+        {PERF_TYPE_HW_CACHE, Cache(PERF_COUNT_HW_CACHE_L1I)},
+        {PERF_TYPE_HW_CACHE, Cache(PERF_COUNT_HW_CACHE_ITLB)},
+    };
+    for (int C = 0; C < NumCounters; ++C) {
+      perf_event_attr Attr;
+      memset(&Attr, 0, sizeof(Attr));
+      Attr.size = sizeof(Attr);
+      Attr.type = Events[C].Type;
+      Attr.config = Events[C].Config;
+      Attr.disabled = 1;
+      Attr.exclude_kernel = 1;
+      Attr.exclude_hv = 1;
+      Attr.read_format =
+          PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      FDs[C] = syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0);
+    }
+#endif
+  }
+
+  ~PerfCounters() {
+#ifdef __linux__
+    for (int FD : FDs)
+      if (FD >= 0)
+        close(FD);
+#endif
+  }
+
+  PerfCounters(const PerfCounters &) = delete;
+  PerfCounters &operator=(const PerfCounters &) = delete;
+
+  bool isAvailable(Counter C) const { return FDs[C] >= 0; }
+
+  bool anyAvailable() const {
+    for (int FD : FDs)
+      if (FD >= 0)
+        return true;
+    return false;
+  }
+
+  /// Reset and start every available counter.
+  void start() {
+#ifdef __linux__
+    for (int FD : FDs)
+      if (FD >= 0) {
+        ioctl(FD, PERF_EVENT_IOC_RESET, 0);
+        ioctl(FD, PERF_EVENT_IOC_ENABLE, 0);
+      }
+#endif
+  }
+
+  void stop() {
+#ifdef __linux__
+    for (int FD : FDs)
+      if (FD >= 0)
+        ioctl(FD, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+  }
+
+  /// The count between start() and stop(); 0 if unavailable.
+  uint64_t read(Counter C) const {
+#ifdef __linux__
+    uint64_t Values[3]; // value, time enabled, time running
+    if (FDs[C] < 0 || ::read(FDs[C], Values, sizeof(Values)) != sizeof(Values))
+      return 0;
+    if (Values[2] && Values[2] < Values[1])
+      return uint64_t(double(Values[0]) * Values[1] / Values[2]);
+    return Values[0];
+#else
+    return 0;
+#endif
+  }
+
+private:
+  int FDs[NumCounters];
+};
+
+#endif // MYLANG_PERFCOUNTERS_H
@@ -0,0 +1,101 @@
+//===- PhaseStats.h - Compile/evaluate time split ---------------*- C++ -*-===//
+//
+// Both front ends (my-lang.cpp and toy.cpp) time compilation and evaluation
+// the same way, so mylang_diff can compare them. With MYLANG_PHASE_STATS set
+// in the environment they print one line at exit, including exits through
+// exit() on errors:
+//
+//   phase-stats: compile-ns=N eval-ns=N
+//
+// Compile time is IR generation and optimization plus the JIT's code
+// generation and linking, wherever that runs: in a lookup, lazily inside an
+// evaluation, or on a pipeline worker. Evaluation time is the time spent in
+// JIT'd expression code minus whatever that thread compiled meanwhile;
+// the bookkeeping of lazy compilation (trampolines, symbol lookups) stays in
+// the evaluation time, since that is what laziness costs the program.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_PHASESTATS_H
+#define MYLANG_PHASESTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace phase_stats {
+
+inline uint64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+inline std::atomic<uint64_t> &compileNanos() {
+  static std::atomic<uint64_t> N{0};
+  return N;
+}
+
+inline std::atomic<uint64_t> &evalNanos() {
+  static std::atomic<uint64_t> N{0};
+  return N;
+}
+
+// Compilation done by the calling thread, to take out of its evaluations.
+inline uint64_t &threadCompileNanos() {
+  static thread_local uint64_t N = 0;
+  return N;
+}
+
+inline unsigned &threadCompileDepth() {
+  static thread_local unsigned N = 0;
+  return N;
+}
+
+/// Adds its lifetime to the compile time. Timers nest (linking one object
+/// can compile and link the code it calls); only the outermost one counts.
+class CompileTimer {
+  uint64_t Start = now();
+
+public:
+  CompileTimer() { ++threadCompileDepth(); }
+  ~CompileTimer() {
+    if (--threadCompileDepth())
+      return;
+    uint64_t D = now() - Start;
+    compileNanos() += D;
+    threadCompileNanos() += D;
+  }
+};
+
+/// Adds its lifetime, less any compilation it contains, to the evaluation
+/// time.
+class EvalTimer {
+  uint64_t Start = now();
+  uint64_t CompiledBefore = threadCompileNanos();
+
+public:
+  ~EvalTimer() {
+    uint64_t D = now() - Start;
+    uint64_t Compiled = threadCompileNanos() - CompiledBefore;
+    evalNanos() += D > Compiled ? D - Compiled : 0;
+  }
+};
+
+inline void print() {
+  fprintf(stderr, "\nphase-stats: compile-ns=%llu eval-ns=%llu\n",
+          (unsigned long long)compileNanos().load(),
+          (unsigned long long)evalNanos().load());
+}
+
+/// Call once from main.
+inline void printAtExitIfRequested() {
+  if (getenv("MYLANG_PHASE_STATS"))
+    atexit(print);
+}
+
+} // end namespace phase_stats
+
+#endif // MYLANG_PHASESTATS_H
@@ -0,0 +1,409 @@
+//===- SamplingProfiler.h - In-process profiler for JIT'd code --*- C++ -*-===//
+//
+// Samples the instruction pointer of the threads that run JIT'd code, each
+// on a timer of its own CPU time, and attributes the samples to definitions
+// using the JIT's own view of what it linked where, so no external tools or
+// perf map files are needed. The thread that starts the profiler is sampled
+// while it is inside a Scope; threads that only run JIT'd code (the
+// -async-workers executor, the par(...) pool) attach themselves and are
+// sampled until they detach.
+//
+// The SIGPROF handler only appends the interrupted IP and return address to
+// its thread's ring buffer; samples are resolved to names later, by
+// whichever thread prints or frees code. Objects are resolved before they
+// are freed, so addresses reused by later objects are never misattributed.
+// Return addresses come from the frame pointer, so JIT'd code should keep
+// frame pointers ("frame-pointer"="all") for the caller/callee profile;
+// for native code they are found by scanning the top of the stack.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_SAMPLINGPROFILER_H
+#define MYLANG_SAMPLINGPROFILER_H
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#endif
+
+namespace llvm {
+namespace orc {
+
+class SamplingProfiler : public JITEventListener {
+  struct Sample {
+    uint64_t IP;
+    uint64_t Return; // 0 when the frame could not be walked
+  };
+
+  struct Range {
+    uint64_t End;
+    std::string Name;
+  };
+
+  // One per sampled thread, kept until the profiler goes away so the
+  // handler never sees a freed one. The handler appends at Head, on its own
+  // thread only; drain() consumes up to it and advances Tail.
+  struct ThreadSamples {
+    std::unique_ptr<Sample[]> Buffer; // left uninitialized until used
+    size_t Capacity;
+    std::atomic<size_t> Head{0}, Tail{0};
+    std::atomic<bool> InJITCode{false};
+    uintptr_t StackLo = 0, StackHi = 0;
+#ifdef __linux__
+    timer_t Timer;
+    bool Armed = false;
+#endif
+  };
+
+  static ThreadSamples *&current() {
+    static thread_local ThreadSamples *T = nullptr;
+    return T;
+  }
+
+  size_t Capacity;
+  std::atomic<uint64_t> Dropped{0};
+  // Bounds of everything JIT'd so far, so the handler can tell JIT'd code
+  // from native code without taking a lock.
+  std::atomic<uint64_t> CodeLo{UINT64_MAX};
+  std::atomic<uint64_t> CodeHi{0};
+  static constexpr unsigned MaxScanWords = 64;
+
+  std::mutex M;
+  std::vector<std::unique_ptr<ThreadSamples>> Threads;
+  std::map<uint64_t, Range> Ranges; // JIT'd functions by start address
+  std::map<ObjectKey, std::vector<uint64_t>> ObjectRanges;
+  std::map<std::string, uint64_t> Self;
+  std::map<std::pair<std::string, std::string>, uint64_t> Calls;
+  uint64_t Total = 0;
+  unsigned IntervalUs = 0;
+  bool Running = false;
+
+  static std::atomic<SamplingProfiler *> &active() {
+    static std::atomic<SamplingProfiler *> Active{nullptr};
+    return Active;
+  }
+
+#ifdef __linux__
+  static void handleSignal(int, siginfo_t *, void *Context) {
+    SamplingProfiler *P = active().load(std::memory_order_relaxed);
+    ThreadSamples *T = current();
+    if (!P || !T || !T->InJITCode.load(std::memory_order_relaxed))
+      return;
+    auto *UC = static_cast<ucontext_t *>(Context);
+    uint64_t IP = 0, FP = 0, SP = 0;
+#if defined(__x86_64__)
+    IP = UC->uc_mcontext.gregs[REG_RIP];
+    FP = UC->uc_mcontext.gregs[REG_RBP];
+    SP = UC->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    IP = UC->uc_mcontext.pc;
+    FP = UC->uc_mcontext.regs[29];
+    SP = UC->uc_mcontext.sp;
+#endif
+    uint64_t Lo = P->CodeLo.load(std::memory_order_relaxed);
+    uint64_t Hi = P->CodeHi.load(std::memory_order_relaxed);
+    uint64_t Return = 0;
+    if (IP >= Lo && IP < Hi) {
+      // JIT'd code keeps frame pointers; follow the one into our stack.
+      if (FP >= T->StackLo && FP + 16 <= T->StackHi)
+        Return = reinterpret_cast<const uint64_t *>(FP)[1];
+    } else if (SP >= T->StackLo && SP < T->StackHi) {
+      // Native code (libm, the runtime) usually has none: take the nearest
+      // word on the stack that points into JIT'd code as its return address.
+      uint64_t End = std::min<uint64_t>(SP + 8 * MaxScanWords, T->StackHi);
+      for (uint64_t A = SP; A + 8 <= End; A += 8) {
+        uint64_t W = *reinterpret_cast<const uint64_t *>(A);
+        if (W >= Lo && W < Hi) {
+          Return = W;
+          break;
+        }
+      }
+    }
+
+    size_t H = T->Head.load(std::memory_order_relaxed);
+    if (H - T->Tail.load(std::memory_order_acquire) >= T->Capacity) {
+      P->Dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    T->Buffer[H % T->Capacity] = {IP, Return};
+    T->Head.store(H + 1, std::memory_order_release);
+  }
+
+  bool arm(ThreadSamples &T) {
+    struct sigevent SEV;
+    memset(&SEV, 0, sizeof(SEV));
+    SEV.sigev_notify = SIGEV_THREAD_ID;
+    SEV.sigev_signo = SIGPROF;
+    SEV._sigev_un._tid = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &SEV, &T.Timer))
+      return false;
+    struct itimerspec Spec;
+    Spec.it_interval.tv_sec = IntervalUs / 1000000;
+    Spec.it_interval.tv_nsec = (IntervalUs % 1000000) * 1000;
+    Spec.it_value = Spec.it_interval;
+    if (timer_settime(T.Timer, 0, &Spec, nullptr)) {
+      timer_delete(T.Timer);
+      return false;
+    }
+    T.Armed = true;
+    return true;
+  }
+#endif
+
+  // Register the calling thread and start its timer. Called with M held.
+  bool attachLocked(bool Always) {
+#ifdef __linux__
+    if (current())
+      return true;
+    auto T = std::make_unique<ThreadSamples>();
+    T->Buffer.reset(new Sample[Capacity]);
+    T->Capacity = Capacity;
+    T->InJITCode = Always;
+    pthread_attr_t Attr;
+    if (pthread_getattr_np(pthread_self(), &Attr) == 0) {
+      void *Addr;
+      size_t Size;
+      if (pthread_attr_getstack(&Attr, &Addr, &Size) == 0) {
+        T->StackLo = reinterpret_cast<uintptr_t>(Addr);
+        T->StackHi = T->StackLo + Size;
+      }
+      pthread_attr_destroy(&Attr);
+    }
+    // Published before the timer can fire.
+    current() = T.get();
+    if (!arm(*T)) {
+      current() = nullptr;
+      return false;
+    }
+    Threads.push_back(std::move(T));
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  std::string resolve(uint64_t Addr) const {
+    auto I = Ranges.upper_bound(Addr);
+    if (I == Ranges.begin() || Addr >= std::prev(I)->second.End)
+      return "<native>";
+    return std::prev(I)->second.Name;
+  }
+
+  // Fold pending samples into the profile. Called with M held; the
+  // handlers may go on appending meanwhile.
+  void drain() {
+    for (auto &T : Threads) {
+      size_t H = T->Head.load(std::memory_order_acquire);
+      for (size_t I = T->Tail.load(std::memory_order_relaxed); I < H; ++I) {
+        const Sample &S = T->Buffer[I % T->Capacity];
+        std::string Callee = resolve(S.IP);
+        ++Self[Callee];
+        ++Total;
+        if (S.Return)
+          ++Calls[{resolve(S.Return), Callee}];
+      }
+      T->Tail.store(H, std::memory_order_release);
+    }
+  }
+
+public:
+  /// On the thread that started the profiler, samples are only kept while
+  /// a Scope is open, i.e. while the host is running JIT'd code (and
+  /// whatever that calls or compiles lazily). Elsewhere it does nothing.
+  class Scope {
+    ThreadSamples *T;
+
+  public:
+    explicit Scope(SamplingProfiler *P) : T(P ? current() : nullptr) {
+      if (T)
+        T->InJITCode.store(true, std::memory_order_relaxed);
+    }
+    ~Scope() {
+      if (T)
+        T->InJITCode.store(false, std::memory_order_relaxed);
+    }
+  };
+
+  /// \p Capacity is in samples per thread.
+  explicit SamplingProfiler(size_t Capacity = 1 << 16) : Capacity(Capacity) {}
+
+  ~SamplingProfiler() override { stop(); }
+
+  /// Start sampling the calling thread every \p Interval microseconds of
+  /// its CPU time, inside Scopes. Returns false where that is not
+  /// supported.
+  bool start(unsigned Interval) {
+#ifdef __linux__
+    std::lock_guard<std::mutex> Lock(M);
+    if (Running)
+      return true;
+    struct sigaction SA;
+    memset(&SA, 0, sizeof(SA));
+    SA.sa_sigaction = handleSignal;
+    SA.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&SA.sa_mask);
+    if (sigaction(SIGPROF, &SA, nullptr))
+      return false;
+
+    IntervalUs = std::max(1u, Interval);
+    active().store(this);
+    if (!attachLocked(/*Always=*/false)) {
+      active().store(nullptr);
+      return false;
+    }
+    Running = true;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  /// Sample the calling thread too, for as long as it runs, until
+  /// detachThread(). For threads that do nothing but run JIT'd code.
+  void attachThread() {
+    std::lock_guard<std::mutex> Lock(M);
+    if (Running)
+      attachLocked(/*Always=*/true);
+  }
+
+  /// Stop sampling the calling thread; its samples stay in the profile.
+  void detachThread() {
+#ifdef __linux__
+    std::lock_guard<std::mutex> Lock(M);
+    ThreadSamples *T = current();
+    if (!T)
+      return;
+    if (T->Armed)
+      timer_delete(T->Timer);
+    T->Armed = false;
+    current() = nullptr;
+#endif
+  }
+
+  /// Stop sampling every thread.
+  void stop() {
+#ifdef __linux__
+    std::lock_guard<std::mutex> Lock(M);
+    if (!Running)
+      return;
+    for (auto &T : Threads) {
+      if (T->Armed)
+        timer_delete(T->Timer);
+      T->Armed = false;
+      T->InJITCode = false;
+    }
+    Running = false;
+    active().store(nullptr);
+#endif
+  }
+
+  void notifyObjectLoaded(ObjectKey K, const object::ObjectFile &Obj,
+                          const RuntimeDyld::LoadedObjectInfo &L) override {
+    // The debug object has its sections at their load addresses.
+    auto DebugObj = L.getObjectForDebug(Obj);
+    const object::ObjectFile &Loaded =
+        DebugObj.getBinary() ? *DebugObj.getBinary() : Obj;
+    std::lock_guard<std::mutex> Lock(M);
+    for (auto &P : object::computeSymbolSizes(Loaded)) {
+      auto Type = P.first.getType();
+      auto Name = P.first.getName();
+      auto Addr = P.first.getAddress();
+      if (!Type || !Name || !Addr || *Type != object::SymbolRef::ST_Function ||
+          !P.second) {
+        consumeError(Type.takeError());
+        consumeError(Name.takeError());
+        consumeError(Addr.takeError());
+        continue;
+      }
+      StringRef Display = *Name;
+      Display.consume_back(".impl");
+      Ranges[*Addr] = {*Addr + P.second, Display.str()};
+      if (*Addr < CodeLo.load())
+        CodeLo.store(*Addr);
+      if (*Addr + P.second > CodeHi.load())
+        CodeHi.store(*Addr + P.second);
+      ObjectRanges[K].push_back(*Addr);
+    }
+  }
+
+  void notifyFreeingObject(ObjectKey K) override {
+    std::lock_guard<std::mutex> Lock(M);
+    drain();
+    auto I = ObjectRanges.find(K);
+    if (I == ObjectRanges.end())
+      return;
+    for (uint64_t Addr : I->second)
+      Ranges.erase(Addr);
+    ObjectRanges.erase(I);
+  }
+
+  /// Print the flat profile and, per definition, the callers its samples
+  /// were taken under.
+  void print(raw_ostream &OS) {
+    std::lock_guard<std::mutex> Lock(M);
+    drain();
+
+    OS << "profile: " << Total << " samples every " << IntervalUs
+       << " us of CPU time";
+    if (Threads.size() > 1)
+      OS << " on " << Threads.size() << " threads";
+    if (uint64_t D = Dropped.load())
+      OS << ", " << D << " dropped";
+    OS << "\n";
+    if (!Total)
+      return;
+
+    std::vector<std::pair<uint64_t, std::string>> Flat;
+    for (auto &KV : Self)
+      Flat.push_back({KV.second, KV.first});
+    std::sort(Flat.begin(), Flat.end(),
+              [](const std::pair<uint64_t, std::string> &A,
+                 const std::pair<uint64_t, std::string> &B) {
+                return A.first != B.first ? A.first > B.first
+                                          : A.second < B.second;
+              });
+    OS << "   self%   samples  definition\n";
+    for (auto &F : Flat)
+      OS << format("%7.2f%% %9llu  %s\n", 100.0 * F.first / Total,
+                   (unsigned long long)F.first, F.second.c_str());
+
+    OS << "callers (samples in definition, by the definition it returns "
+          "to):\n";
+    for (auto &F : Flat) {
+      std::vector<std::pair<uint64_t, std::string>> Callers;
+      for (auto &KV : Calls)
+        if (KV.first.second == F.second)
+          Callers.push_back({KV.second, KV.first.first});
+      if (Callers.empty())
+        continue;
+      std::sort(Callers.rbegin(), Callers.rend());
+      OS << "  " << F.second << "\n";
+      for (auto &C : Callers)
+        OS << format("    %9llu  %s\n", (unsigned long long)C.first,
+                     C.second.c_str());
+    }
+  }
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // MYLANG_SAMPLINGPROFILER_H
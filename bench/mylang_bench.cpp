@@ -0,0 +1,339 @@
+//
+// mylang_bench - the compiler's phases, one benchmark each.
+//
+// Usage: mylang_bench [--benchmark_filter=<regex>]
+//                     [--benchmark_out=results.json] [benchmark flags]
+//
+// Every phase runs over every input: the files in corpus/ and generated
+// programs of a few sizes (tools/WorkloadGen.h, default shape and seed).
+// Benchmarks are named <phase>/<input>, with opt/<pass>/<input> for each
+// function pass, and sessions/<input>/threads:N for independent compiler
+// sessions compiling concurrently. Each one is repeated (10 times unless
+// --benchmark_repetitions says otherwise) and reported as the median and
+// p99 of the repetitions; --benchmark_out writes them as JSON for
+// comparing builds.
+//
+#define MYLANG_NO_MAIN
+#include "../my-lang.cpp"
+#include "../tools/WorkloadGen.h"
+
+#include "llvm/Support/MemoryBuffer.h"
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+struct BenchInput {
+   std::string Name;
+   std::string Source;
+};
+
+static std::vector<BenchInput> loadInputs() {
+   std::vector<BenchInput> Inputs;
+   for (const char *File : {"arith.k", "calls.k", "reductions.k", "bulk.k"}) {
+      std::ifstream In(std::string(MYLANG_CORPUS_DIR "/") + File);
+      if (!In) {
+         fprintf(stderr, "Cannot open corpus file %s\n", File);
+         continue;
+      }
+      std::stringstream SS;
+      SS << In.rdbuf();
+      Inputs.push_back({File, SS.str()});
+   }
+   for (unsigned N : {32u, 256u}) {
+      WorkloadShape Shape;
+      Shape.Definitions = N;
+      Inputs.push_back({"gen" + std::to_string(N), generateWorkload(Shape)});
+   }
+   return Inputs;
+}
+
+// The session the single-threaded benchmarks compile in.
+static CompilerSession Main;
+
+static std::vector<std::unique_ptr<TopLevelItem>>
+parseAll(CompilerSession &S, const std::string &Source) {
+   S.Decls = std::make_shared<Declarations>();
+   FILE *F = fmemopen((void *)Source.data(), Source.size(), "r");
+   setLexerInput(F);
+   getNextToken();
+   std::vector<std::unique_ptr<TopLevelItem>> Items;
+   while (auto Item = ParseItem(S))
+      Items.push_back(std::move(Item));
+   fclose(F);
+   return Items;
+}
+
+static bool hasBody(const TopLevelItem &Item) {
+   return Item.Kind == TopLevelItem::Definition ||
+          Item.Kind == TopLevelItem::Expression;
+}
+
+// Codegen Item into a fresh module, leaving it unoptimized.
+static Function *codegenItem(CompilerSession &S, const TopLevelItem &Item) {
+   S.Builder.reset();
+   S.TheModule.reset();
+   InitializeModule(S);
+   S.CurItem = Item.Seq;
+   if (Item.Kind == TopLevelItem::Extern)
+      return Item.Proto->codegen(S);
+   return Item.FnAST->codegen(S);
+}
+
+// Codegen and optimize every item with a body into an object file.
+// Expressions get unique names so they can all be linked at once, and of
+// redefined functions only the last definition is kept.
+struct CompiledInput {
+   std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+   std::vector<std::string> Symbols;     // one per object
+   std::vector<std::string> Expressions; // in source order
+};
+
+static CompiledInput compileAll(CompilerSession &S,
+                                const std::string &Source) {
+   CompiledInput C;
+   std::map<std::string, size_t> Defined;
+   for (auto &Item : parseAll(S, Source)) {
+      if (!hasBody(*Item))
+         continue;
+      Function *F = codegenItem(S, *Item);
+      if (!F)
+         continue;
+      std::string Name = std::string(F->getName());
+      if (Item->Kind == TopLevelItem::Expression) {
+         Name += "." + std::to_string(Item->Seq);
+         F->setName(Name);
+         C.Expressions.push_back(Name);
+      }
+      createFunctionPassManager(S, getFunctionPasses())->run(*F);
+      auto Obj = ExitOnErr(SimpleCompiler(*S.TheTM)(*S.TheModule));
+      auto D = Defined.find(Name);
+      if (D != Defined.end()) {
+         C.Objects[D->second] = std::move(Obj);
+         continue;
+      }
+      Defined[Name] = C.Objects.size();
+      C.Objects.push_back(std::move(Obj));
+      C.Symbols.push_back(Name);
+   }
+   return C;
+}
+
+static ResourceTrackerSP linkAll(const CompiledInput &C) {
+   auto RT = Main.TheJIT->getMainJITDylib().createResourceTracker();
+   for (auto &Obj : C.Objects)
+      ExitOnErr(Main.TheJIT->addObjectFile(
+              MemoryBuffer::getMemBufferCopy(Obj->getBuffer(),
+                                             Obj->getBufferIdentifier()),
+              RT));
+   for (auto &Sym : C.Symbols)
+      ExitOnErr(Main.TheJIT->lookup(Sym));
+   return RT;
+}
+
+template <typename FnT> static double secondsOf(FnT Fn) {
+   auto T0 = std::chrono::steady_clock::now();
+   Fn();
+   auto T1 = std::chrono::steady_clock::now();
+   return std::chrono::duration<double>(T1 - T0).count();
+}
+
+// lex: the whole input to tokens.
+static void BM_Lex(benchmark::State &State, const BenchInput *In) {
+   size_t Tokens = 0;
+   for (auto _ : State) {
+      FILE *F = fmemopen((void *)In->Source.data(), In->Source.size(), "r");
+      setLexerInput(F);
+      while (gettok() != tok_eof)
+         ++Tokens;
+      fclose(F);
+   }
+   State.SetBytesProcessed(State.iterations() * In->Source.size());
+   State.counters["tokens"] = benchmark::Counter(
+           Tokens, benchmark::Counter::kAvgIterations);
+}
+
+// parse: the whole input to ASTs, lexing included.
+static void BM_Parse(benchmark::State &State, const BenchInput *In) {
+   for (auto _ : State) {
+      auto Items = parseAll(Main, In->Source);
+      State.PauseTiming();
+      Items.clear();
+      State.ResumeTiming();
+   }
+   State.SetBytesProcessed(State.iterations() * In->Source.size());
+}
+
+// codegen: every item to unoptimized IR, each in a fresh module.
+static void BM_Codegen(benchmark::State &State, const BenchInput *In) {
+   auto Items = parseAll(Main, In->Source);
+   for (auto _ : State)
+      for (auto &Item : Items)
+         if (hasBody(*Item) || Item->Kind == TopLevelItem::Extern)
+            benchmark::DoNotOptimize(codegenItem(Main, *Item));
+   State.SetItemsProcessed(State.iterations() * Items.size());
+}
+
+// opt/<pass>: one function pass, including the analyses it requires, on
+// IR that has been through the passes before it.
+static void BM_Pass(benchmark::State &State, const BenchInput *In,
+                    size_t PassIdx) {
+   ArrayRef<FunctionPassInfo> Passes = getFunctionPasses();
+   auto Items = parseAll(Main, In->Source);
+   for (auto _ : State) {
+      double Seconds = 0;
+      for (auto &Item : Items) {
+         if (!hasBody(*Item))
+            continue;
+         Function *F = codegenItem(Main, *Item);
+         if (!F)
+            continue;
+         createFunctionPassManager(Main, Passes.take_front(PassIdx))->run(*F);
+         auto FPM = createFunctionPassManager(Main, Passes.slice(PassIdx, 1));
+         Seconds += secondsOf([&] { FPM->run(*F); });
+      }
+      State.SetIterationTime(Seconds);
+   }
+}
+
+// mc: optimized IR to an object file.
+static void BM_MC(benchmark::State &State, const BenchInput *In) {
+   auto Items = parseAll(Main, In->Source);
+   for (auto _ : State) {
+      double Seconds = 0;
+      for (auto &Item : Items) {
+         if (!hasBody(*Item))
+            continue;
+         Function *F = codegenItem(Main, *Item);
+         if (!F)
+            continue;
+         createFunctionPassManager(Main, getFunctionPasses())->run(*F);
+         SimpleCompiler Compile(*Main.TheTM);
+         Seconds += secondsOf([&] {
+            benchmark::DoNotOptimize(ExitOnErr(Compile(*Main.TheModule)));
+         });
+      }
+      State.SetIterationTime(Seconds);
+   }
+}
+
+// link: add every object to the JIT and resolve all their symbols.
+static void BM_Link(benchmark::State &State, const BenchInput *In) {
+   auto C = compileAll(Main, In->Source);
+   for (auto _ : State) {
+      ResourceTrackerSP RT;
+      State.SetIterationTime(secondsOf([&] { RT = linkAll(C); }));
+      ExitOnErr(RT->remove());
+   }
+   State.SetItemsProcessed(State.iterations() * C.Objects.size());
+}
+
+// lookup: symbols that are already linked.
+static void BM_Lookup(benchmark::State &State, const BenchInput *In) {
+   auto C = compileAll(Main, In->Source);
+   auto RT = linkAll(C);
+   for (auto _ : State)
+      for (auto &Sym : C.Symbols)
+         benchmark::DoNotOptimize(ExitOnErr(Main.TheJIT->lookup(Sym)));
+   State.SetItemsProcessed(State.iterations() * C.Symbols.size());
+   ExitOnErr(RT->remove());
+}
+
+// eval: call every top-level expression once, in source order.
+static void BM_Eval(benchmark::State &State, const BenchInput *In) {
+   auto C = compileAll(Main, In->Source);
+   auto RT = linkAll(C);
+   std::vector<double (*)()> Exprs;
+   for (auto &Name : C.Expressions)
+      Exprs.push_back(
+              (double (*)())(intptr_t)ExitOnErr(Main.TheJIT->lookup(Name))
+                      .getAddress());
+   for (auto _ : State)
+      for (auto *FP : Exprs)
+         benchmark::DoNotOptimize(FP());
+   State.SetItemsProcessed(State.iterations() * Exprs.size());
+   ExitOnErr(RT->remove());
+}
+
+// sessions: every thread compiles the whole input to objects, in a session
+// and JIT of its own. Items per second are summed over the threads, so how
+// they grow with the thread count is how well sessions scale.
+static void BM_Sessions(benchmark::State &State, const BenchInput *In) {
+   CompilerSession S;
+   S.TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+   size_t Objects = 0;
+   for (auto _ : State)
+      Objects += compileAll(S, In->Source).Objects.size();
+   State.SetItemsProcessed(Objects);
+}
+
+// Nearest-rank 99th percentile of the repetitions.
+static double P99(const std::vector<double> &V) {
+   std::vector<double> Sorted(V);
+   std::sort(Sorted.begin(), Sorted.end());
+   size_t Rank = (Sorted.size() * 99 + 99) / 100;
+   return Sorted[std::max<size_t>(Rank, 1) - 1];
+}
+
+static void registerBenchmarks(const std::vector<BenchInput> &Inputs) {
+   auto Reg = [](const std::string &Name, auto Fn, bool ManualTime) {
+      auto *B = benchmark::RegisterBenchmark(Name.c_str(), Fn)
+                        ->Unit(benchmark::kMicrosecond)
+                        ->ComputeStatistics("p99", P99);
+      if (ManualTime)
+         B->UseManualTime();
+   };
+   for (auto &In : Inputs) {
+      const BenchInput *P = &In;
+      Reg("lex/" + In.Name, [P](benchmark::State &S) { BM_Lex(S, P); }, false);
+      Reg("parse/" + In.Name, [P](benchmark::State &S) { BM_Parse(S, P); },
+          false);
+      Reg("codegen/" + In.Name,
+          [P](benchmark::State &S) { BM_Codegen(S, P); }, false);
+      auto &Passes = getFunctionPasses();
+      for (size_t I = 0; I < Passes.size(); ++I)
+         Reg(std::string("opt/") + Passes[I].Name + "/" + In.Name,
+             [P, I](benchmark::State &S) { BM_Pass(S, P, I); }, true);
+      Reg("mc/" + In.Name, [P](benchmark::State &S) { BM_MC(S, P); }, true);
+      Reg("link/" + In.Name, [P](benchmark::State &S) { BM_Link(S, P); },
+          true);
+      Reg("lookup/" + In.Name,
+          [P](benchmark::State &S) { BM_Lookup(S, P); }, false);
+      Reg("eval/" + In.Name, [P](benchmark::State &S) { BM_Eval(S, P); },
+          false);
+      unsigned Cores = std::max(2u, std::thread::hardware_concurrency());
+      benchmark::RegisterBenchmark(
+              ("sessions/" + In.Name).c_str(),
+              [P](benchmark::State &S) { BM_Sessions(S, P); })
+              ->Unit(benchmark::kMicrosecond)
+              ->ComputeStatistics("p99", P99)
+              ->ThreadRange(1, Cores)
+              ->UseRealTime();
+   }
+}
+
+int main(int argc, char **argv) {
+   // Repetitions are what the median and p99 are taken over; explicit
+   // flags come later on the command line and win.
+   std::vector<char *> Args(argv, argv + argc);
+   char Reps[] = "--benchmark_repetitions=10";
+   char AggregatesOnly[] = "--benchmark_report_aggregates_only=true";
+   Args.insert(Args.begin() + 1, {Reps, AggregatesOnly});
+   int NumArgs = Args.size();
+   benchmark::Initialize(&NumArgs, Args.data());
+   if (benchmark::ReportUnrecognizedArguments(NumArgs, Args.data()))
+      return 1;
+
+   InitializeNativeTarget();
+   InitializeNativeTargetAsmPrinter();
+   InitializeNativeTargetAsmParser();
+
+   Batch = true; // no prompts or IR dumps
+   Main.TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+
+   auto Inputs = loadInputs();
+   registerBenchmarks(Inputs);
+   benchmark::RunSpecifiedBenchmarks();
+   benchmark::Shutdown();
+   return 0;
+}
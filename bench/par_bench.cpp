@@ -0,0 +1,106 @@
+//
+// par_bench - recursive kernels with par(...) on 1, 2, 4, ... workers.
+//
+// Usage: par_bench [fib-n] [reps] [max-workers]
+//
+// Each kernel also has a version without par; "seq" is its time, and the
+// speedups are relative to it.
+//
+#define MYLANG_NO_MAIN
+#include "../my-lang.cpp"
+
+#include <chrono>
+
+// psum sums i*i over [lo, hi) by halving the range down to 4096 elements,
+// so it wants a power-of-two span.
+static const char *Source =
+        "def fib(n) (n < 2) * n + sum i = 0, (1 < n) in "
+        "par(fib(n - 1), fib(n - 2));\n"
+        "def sfib(n) (n < 2) * n + sum i = 0, (1 < n) in "
+        "sfib(n - 1) + sfib(n - 2);\n"
+        "def psum(lo hi) var m = (lo + hi) * 0.5 in "
+        "(hi - lo < 4097) * (sum i = lo, hi in i * i) + "
+        "sum k = 0, (4096 < hi - lo) in par(psum(lo, m), psum(m, hi));\n"
+        "def ssum(lo hi) var m = (lo + hi) * 0.5 in "
+        "(hi - lo < 4097) * (sum i = lo, hi in i * i) + "
+        "sum k = 0, (4096 < hi - lo) in ssum(lo, m) + ssum(m, hi);\n";
+
+// Best-of-reps wall time in milliseconds.
+template <typename FnT> static double timeBest(FnT Fn, int Reps, double &Result) {
+   double Best = 1e300;
+   for (int R = 0; R < Reps; ++R) {
+      auto T0 = std::chrono::steady_clock::now();
+      Result = Fn();
+      auto T1 = std::chrono::steady_clock::now();
+      Best = std::min(
+              Best, std::chrono::duration<double, std::milli>(T1 - T0).count());
+   }
+   return Best;
+}
+
+int main(int argc, char **argv) {
+   double FibN = argc > 1 ? atof(argv[1]) : 30;
+   int Reps = argc > 2 ? atoi(argv[2]) : 5;
+   unsigned MaxWorkers = argc > 3 ? atoi(argv[3])
+                                  : std::max(1u, std::thread::hardware_concurrency());
+
+   InitializeNativeTarget();
+   InitializeNativeTargetAsmPrinter();
+   InitializeNativeTargetAsmParser();
+
+   CompilerSession S;
+   S.TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+   InitializeModulePassManager(S);
+
+   Input = fmemopen((void *)Source, strlen(Source), "r");
+   getNextToken();
+   MainLoop(S);
+   fprintf(stderr, "\n");
+
+   auto Fn1 = [&](const char *Name) {
+      return (double (*)(double))(intptr_t)ExitOnErr(S.TheJIT->lookup(Name))
+              .getAddress();
+   };
+   auto Fn2 = [&](const char *Name) {
+      return (double (*)(double, double))(intptr_t)ExitOnErr(
+                     S.TheJIT->lookup(Name))
+              .getAddress();
+   };
+   auto *Fib = Fn1("fib"), *SFib = Fn1("sfib");
+   auto *PSum = Fn2("psum"), *SSum = Fn2("ssum");
+   double Span = 1 << 24;
+
+   struct Case {
+      std::string Name;
+      std::function<double()> Par, Seq;
+   } Cases[] = {
+           {"fib(" + std::to_string((int)FibN) + ")", [&] { return Fib(FibN); },
+            [&] { return SFib(FibN); }},
+           {"psum(2^24)", [&] { return PSum(0, Span); },
+            [&] { return SSum(0, Span); }}};
+
+   std::vector<unsigned> Counts;
+   for (unsigned W = 1; W < MaxWorkers; W *= 2)
+      Counts.push_back(W);
+   Counts.push_back(MaxWorkers);
+
+   printf("%-12s %10s", "kernel", "seq ms");
+   for (unsigned W : Counts)
+      printf(" %9s", ("x" + std::to_string(W) + "w").c_str());
+   printf("\n");
+   for (auto &C : Cases) {
+      double SeqResult;
+      double SeqMs = timeBest(C.Seq, Reps, SeqResult);
+      printf("%-12s %10.2f", C.Name.c_str(), SeqMs);
+      bool Differ = false;
+      for (unsigned W : Counts) {
+         par_runtime::Scheduler::get().configure(W, 0);
+         double ParResult;
+         double ParMs = timeBest(C.Par, Reps, ParResult);
+         printf(" %9.2f", SeqMs / ParMs);
+         Differ |= ParResult != SeqResult;
+      }
+      printf("%s\n", Differ ? "  (results differ)" : "");
+   }
+   return 0;
+}
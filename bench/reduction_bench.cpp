@@ -0,0 +1,81 @@
+//
+// reduction_bench - JIT'd reduction builtins against hand-written C++ loops.
+//
+// Usage: reduction_bench [n] [reps]
+//
+// "strict" is the C++ loop at -O3 with IEEE semantics, which keeps a single
+// accumulator; "fast" is the same loop with -ffast-math -march=native, the
+// semantics and target the JIT'd reductions are compiled with. Ratios are
+// C++ time over JIT time.
+//
+#define MYLANG_NO_MAIN
+#include "../my-lang.cpp"
+
+#include <chrono>
+
+double sumsq_ref(double n);
+double maxpoly_ref(double n);
+double sumsq_fast(double n);
+double maxpoly_fast(double n);
+
+static const char *Source =
+        "def sumsq(n) sum i = 0, n in i * i;\n"
+        "def maxpoly(n) max i = 0, n in i * (n - i);\n";
+
+// Best-of-reps wall time in nanoseconds per element.
+template <typename FnT>
+static double timeLoop(FnT Fn, double N, int Reps, double &Result) {
+   double Best = 1e300;
+   for (int R = 0; R < Reps; ++R) {
+      auto T0 = std::chrono::steady_clock::now();
+      Result = Fn(N);
+      auto T1 = std::chrono::steady_clock::now();
+      double Ns = std::chrono::duration<double, std::nano>(T1 - T0).count();
+      Best = std::min(Best, Ns / N);
+   }
+   return Best;
+}
+
+int main(int argc, char **argv) {
+   double N = argc > 1 ? atof(argv[1]) : 1 << 24;
+   int Reps = argc > 2 ? atoi(argv[2]) : 10;
+
+   InitializeNativeTarget();
+   InitializeNativeTargetAsmPrinter();
+   InitializeNativeTargetAsmParser();
+
+   CompilerSession S;
+   S.TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+   InitializeModulePassManager(S);
+
+   Input = fmemopen((void *)Source, strlen(Source), "r");
+   getNextToken();
+   MainLoop(S);
+   fprintf(stderr, "\n");
+
+   struct Case {
+      const char *Name;
+      double (*Ref)(double);
+      double (*Fast)(double);
+   } Cases[] = {{"sumsq", sumsq_ref, sumsq_fast},
+                {"maxpoly", maxpoly_ref, maxpoly_fast}};
+
+   printf("%-10s %12s %12s %12s %8s %8s\n", "kernel", "jit ns/el",
+          "strict ns/el", "fast ns/el", "strict", "fast");
+   for (auto &C : Cases) {
+      auto Sym = ExitOnErr(S.TheJIT->lookup(C.Name));
+      auto *JitFn = (double (*)(double))(intptr_t)Sym.getAddress();
+      double JitResult, RefResult, FastResult;
+      double JitNs = timeLoop(JitFn, N, Reps, JitResult);
+      double RefNs = timeLoop(C.Ref, N, Reps, RefResult);
+      double FastNs = timeLoop(C.Fast, N, Reps, FastResult);
+      auto Differs = [&](double R) {
+         return std::fabs(R - RefResult) > 1e-6 * std::fabs(RefResult);
+      };
+      printf("%-10s %12.4f %12.4f %12.4f %8.2f %8.2f%s\n", C.Name, JitNs,
+             RefNs, FastNs, RefNs / JitNs, FastNs / JitNs,
+             Differs(JitResult) || Differs(FastResult) ? "  (results differ)"
+                                                       : "");
+   }
+   return 0;
+}
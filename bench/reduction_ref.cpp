@@ -0,0 +1,23 @@
+//
+// Hand-written C++ reference loops for reduction_bench, built at -O3.
+// Kept in their own translation unit so the bench can't fold them.
+//
+#include <cmath>
+
+double sumsq_ref(double n) {
+   double Sum = 0.0;
+   for (long K = 0; K < (long)std::ceil(n); ++K) {
+      double I = K;
+      Sum += I * I;
+   }
+   return Sum;
+}
+
+double maxpoly_ref(double n) {
+   double Max = -INFINITY;
+   for (long K = 0; K < (long)std::ceil(n); ++K) {
+      double I = K;
+      Max = std::fmax(Max, I * (n - I));
+   }
+   return Max;
+}
@@ -0,0 +1,25 @@
+//
+// The reference loops of reduction_ref.cpp again, built at -O3 -ffast-math
+// -march=native: the reassociation and no-NaN assumptions and the target
+// the JIT'd reductions get, so the compiler may split the accumulator and
+// vectorize.
+//
+#include <cmath>
+
+double sumsq_fast(double n) {
+   double Sum = 0.0;
+   for (long K = 0; K < (long)std::ceil(n); ++K) {
+      double I = K;
+      Sum += I * I;
+   }
+   return Sum;
+}
+
+double maxpoly_fast(double n) {
+   double Max = -INFINITY;
+   for (long K = 0; K < (long)std::ceil(n); ++K) {
+      double I = K;
+      Max = std::fmax(Max, I * (n - I));
+   }
+   return Max;
+}
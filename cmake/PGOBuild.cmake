@@ -0,0 +1,38 @@
+# Two-stage profile-guided build of llvm_first_lang.
+#
+#   cmake -DBUILD_DIR=<dir> [-DBUILD_TYPE=Release] [-DCMAKE_ARGS="..."] \
+#         -P cmake/PGOBuild.cmake
+#
+# Stage 1 builds an instrumented compiler and runs it over corpus/ (the
+# pgo-train target); stage 2 reconfigures the same build directory, so GCC
+# finds the .gcda files under the same object paths, and rebuilds with the
+# profile.
+
+get_filename_component(SOURCE_DIR "${CMAKE_CURRENT_LIST_DIR}/.." ABSOLUTE)
+if(NOT BUILD_DIR)
+    set(BUILD_DIR "${SOURCE_DIR}/build-pgo")
+endif()
+if(NOT BUILD_TYPE)
+    set(BUILD_TYPE Release)
+endif()
+separate_arguments(extra_args UNIX_COMMAND "${CMAKE_ARGS}")
+
+function(run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+    if(result)
+        message(FATAL_ERROR "Failed: ${ARGN}")
+    endif()
+endfunction()
+
+file(REMOVE_RECURSE "${BUILD_DIR}/pgo")
+
+message(STATUS "PGO stage 1: instrumented build and training run")
+run(${CMAKE_COMMAND} -S "${SOURCE_DIR}" -B "${BUILD_DIR}" ${extra_args}
+        -DCMAKE_BUILD_TYPE=${BUILD_TYPE} -DMYLANG_PGO=GENERATE)
+run(${CMAKE_COMMAND} --build "${BUILD_DIR}" --target llvm_first_lang)
+run(${CMAKE_COMMAND} --build "${BUILD_DIR}" --target pgo-train)
+
+message(STATUS "PGO stage 2: optimized build with the profile")
+run(${CMAKE_COMMAND} -S "${SOURCE_DIR}" -B "${BUILD_DIR}" ${extra_args}
+        -DCMAKE_BUILD_TYPE=${BUILD_TYPE} -DMYLANG_PGO=USE)
+run(${CMAKE_COMMAND} --build "${BUILD_DIR}")
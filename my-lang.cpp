@@ -3,6 +3,7 @@
 //
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
@@ -10,22 +11,47 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize.h"
+#include "AsyncEval.h"
 #include "KaleidoscopeJIT.h"
+#include "PerfCounters.h"
+#include "PhaseStats.h"
+#include "SamplingProfiler.h"
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <malloc.h>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 using namespace llvm;
@@ -43,25 +69,74 @@ enum Token {
     // primary
     tok_identifier = -4,
     tok_number = -5,
+
+    // reductions
+    tok_in = -6,
+    tok_sum = -7,
+    tok_min = -8,
+    tok_max = -9,
+    tok_count = -10,
+    tok_dot = -11,
+
+    // REPL commands, e.g. @mem
+    tok_command = -12,
+
+    // local variables
+    tok_var = -13,
+
+    // fork-join
+    tok_par = -14,
 };
 
-static std::string IdentifierStr; // Filled in if tok_identifier
-static double NumVal;             // Filled in if tok_number
+// Lexer and parser state is per thread, so that sessions on different
+// threads, and the files of a unit, can be parsed at the same time.
+static thread_local std::string IdentifierStr; // tok_identifier/tok_command
+static thread_local double NumVal;             // tok_number
+static thread_local FILE *Input = stdin;       // Source the lexer reads from
+static thread_local int LastChar = ' ';        // Lookahead character
+
+// Point the lexer at a new source, dropping any lookahead from the old one.
+static void setLexerInput(FILE *F) {
+    Input = F;
+    LastChar = ' ';
+}
 
-static int gettok() {
-    static int LastChar = ' ';
+// Whether a number comes next on the current line, for commands that take
+// one (@await 3). A number on a later line starts the next item instead.
+static bool numberFollowsOnLine() {
+    while (LastChar == ' ' || LastChar == '\t')
+        LastChar = getc(Input);
+    return isdigit(LastChar);
+}
 
+static int gettok() {
     while (isspace(LastChar))
-        LastChar = getchar();
+        LastChar = getc(Input);
 
     if (isalpha(LastChar)) {
         IdentifierStr = LastChar;
-        while (isalnum((LastChar = getchar())))
+        while (isalnum((LastChar = getc(Input))))
             IdentifierStr += LastChar;
         if (IdentifierStr == "def")
             return tok_def;
         if (IdentifierStr == "extern")
             return tok_extern;
+        if (IdentifierStr == "in")
+            return tok_in;
+        if (IdentifierStr == "sum")
+            return tok_sum;
+        if (IdentifierStr == "min")
+            return tok_min;
+        if (IdentifierStr == "max")
+            return tok_max;
+        if (IdentifierStr == "count")
+            return tok_count;
+        if (IdentifierStr == "dot")
+            return tok_dot;
+        if (IdentifierStr == "var")
+            return tok_var;
+        if (IdentifierStr == "par")
+            return tok_par;
         return tok_identifier;
     }
 
@@ -69,16 +144,23 @@ static int gettok() {
         std::string NumStr;
         do {
             NumStr += LastChar;
-            LastChar = getchar();
+            LastChar = getc(Input);
         } while (isdigit(LastChar) || LastChar == '.');
 
         NumVal = strtod(NumStr.c_str(), 0);
         return tok_number;
     }
 
+    if (LastChar == '@') { // Command: @[a-zA-Z]+
+        IdentifierStr.clear();
+        while (isalpha((LastChar = getc(Input))))
+            IdentifierStr += LastChar;
+        return tok_command;
+    }
+
     if (LastChar == '#') {
         do
-            LastChar = getchar();
+            LastChar = getc(Input);
         while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         if (LastChar != EOF)
@@ -89,25 +171,261 @@ static int gettok() {
         return tok_eof;
 
     int ThisChar = LastChar;
-    LastChar = getchar();
+    LastChar = getc(Input);
     return ThisChar;
 }
 
 // forward class and function declaration
 class ExprAST;
 class PrototypeAST;
-Function *getFunction(std::string Name);
+class CompilerSession;
+Function *getFunction(CompilerSession &S, std::string Name);
+static Value *emitCancelled(CompilerSession &S);
 
 // global
-static std::unique_ptr<LLVMContext> TheContext;
-static std::unique_ptr<Module> TheModule;
-static std::unique_ptr<IRBuilder<>> Builder;
-static std::map<std::string, Value *> NamedValues;
-static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
-static std::unique_ptr<legacy::FunctionPassManager> TheFPM;
-static std::unique_ptr<KaleidoscopeJIT> TheJIT;
+// Samples the main thread and the threads that run JIT'd code with -profile.
+// Never freed: the JIT notifies it until the JIT itself is destroyed at exit.
+static SamplingProfiler *Profiler = nullptr;
 static ExitOnError ExitOnErr;
 
+// Prototypes by name. Each version is tagged with the top-level item that
+// declared it, and codegen of item N only sees versions from items up to N,
+// so items compiled out of order (-pipeline) resolve calls exactly as they
+// would one at a time.
+struct ProtoVersion {
+    unsigned Item;
+    std::shared_ptr<PrototypeAST> Proto;
+};
+
+// What a session's items declare, shared by the session and its workers.
+struct Declarations {
+    std::map<std::string, std::vector<ProtoVersion>> FunctionProtos;
+    std::mutex ProtosMutex;
+    unsigned NextItemSeq = 0;              // numbers items in source order
+    std::atomic<unsigned> NextCommitItem{0}; // items before it are in the JIT
+    unsigned UnitLastItem = 0; // in a unit, every item sees all of it
+};
+
+// CompilerSession - one compiler: the declarations it knows, the JIT it
+// feeds, and the module it is building. Sessions share nothing, so several
+// can compile at once on different threads. A session builds one module at
+// a time; -pipeline and unit workers each build into a worker session that
+// shares the declarations and JIT of the session it was made from.
+class CompilerSession {
+public:
+    // The module being built, and the passes that optimize it.
+    std::unique_ptr<LLVMContext> TheContext;
+    std::unique_ptr<Module> TheModule;
+    std::unique_ptr<IRBuilder<>> Builder;
+    std::map<std::string, Value *> NamedValues;
+    std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+    std::unique_ptr<TargetMachine> TheTM;
+    unsigned CurItem = 0; // item being compiled
+
+    std::shared_ptr<Declarations> Decls;
+    std::shared_ptr<KaleidoscopeJIT> TheJIT;
+
+    CompilerSession() : Decls(std::make_shared<Declarations>()) {}
+
+    /// A session for another thread, compiling against the same
+    /// declarations into the same JIT.
+    std::unique_ptr<CompilerSession> createWorker() const {
+       auto Worker = std::make_unique<CompilerSession>();
+       Worker->Decls = Decls;
+       Worker->TheJIT = TheJIT;
+       return Worker;
+    }
+};
+
+// With -pipeline, diagnostics and IR dumps are collected per item and
+// printed when the item is committed, so output stays in source order.
+static thread_local std::string *LogSink;
+
+static cl::list<std::string> InputFilenames(
+        cl::Positional,
+        cl::desc("<input files or directories>; several make one unit"));
+static cl::opt<unsigned> UnitWorkers(
+        "unit-workers", cl::init(0),
+        cl::desc("Threads parsing and compiling the files of a unit "
+                 "(0: one per core)"));
+static cl::opt<bool> Batch(
+        "batch",
+        cl::desc("Non-interactive mode: no prompts or IR dumps, no value "
+                 "names, one result per line on stdout"));
+static cl::opt<bool> Pipeline(
+        "pipeline",
+        cl::desc("Parse, compile and commit top-level items on separate "
+                 "threads"));
+static cl::opt<unsigned> PipelineWorkers(
+        "pipeline-workers", cl::init(2),
+        cl::desc("Number of -pipeline codegen/optimization threads"));
+static cl::opt<unsigned> PipelineDepth(
+        "pipeline-depth", cl::init(16),
+        cl::desc("Maximum number of -pipeline items in flight"));
+static cl::opt<uint64_t> JITMemSoftLimit(
+        "jit-mem-soft-limit", cl::init(0),
+        cl::desc("Warn when JIT'd code and data exceed this many bytes"));
+static cl::opt<uint64_t> JITMemHardLimit(
+        "jit-mem-hard-limit", cl::init(0),
+        cl::desc("Reject new definitions once JIT'd code and data exceed "
+                 "this many bytes"));
+static cl::opt<uint64_t> JITCodeBudget(
+        "jit-code-budget", cl::init(0),
+        cl::desc("Evict the machine code of cold definitions while JIT'd "
+                 "code and data exceed this many bytes"));
+static cl::opt<uint64_t> JITHotZone(
+        "jit-hot-zone", cl::init(0),
+        cl::desc("Set aside this many bytes of a contiguous, huge page "
+                 "backed code region for hot definitions, and move "
+                 "definitions there as they become hot"));
+static cl::opt<uint64_t> JITHotCalls(
+        "jit-hot-calls", cl::init(1000),
+        cl::desc("Calls during one top-level evaluation that make a "
+                 "definition hot for -jit-hot-zone"));
+static cl::opt<unsigned> SpeculateDepth(
+        "speculate-depth", cl::init(0),
+        cl::desc("Compile the definitions compiled code calls, up to this "
+                 "many calls deep, in the background before their first "
+                 "call (0: off)"));
+static cl::opt<unsigned> SpeculateThreads(
+        "speculate-threads", cl::init(1),
+        cl::desc("Background threads for -speculate-depth"));
+static cl::opt<bool> SpeculateIdle(
+        "speculate-idle", cl::init(true),
+        cl::desc("Run -speculate-depth threads only on otherwise idle CPU "
+                 "time"));
+static cl::opt<unsigned> ParWorkers(
+        "par-workers", cl::init(0),
+        cl::desc("Threads that run par(...) operands, counting the one that "
+                 "forks (0: one per core, 1: never fork)"));
+static cl::opt<unsigned> ParCutoff(
+        "par-cutoff", cl::init(0),
+        cl::desc("Evaluate a par(...) nested inside this many others "
+                 "sequentially (0: about eight tasks per worker)"));
+static cl::opt<unsigned> AsyncWorkers(
+        "async-workers", cl::init(0),
+        cl::desc("Evaluate top-level expressions on this many executor "
+                 "threads while later input is read and compiled; results "
+                 "still print in source order (0: evaluate each one before "
+                 "reading on)"));
+static cl::opt<std::string> PreludeFilename(
+        "prelude", cl::desc("Definitions and externs to read before the input"));
+static cl::opt<std::string> PreludeSnapshot(
+        "prelude-snapshot",
+        cl::desc("Load the compiled -prelude from this file, or compile it "
+                 "and write the file if it is missing or stale"));
+static cl::opt<bool> StartupStats(
+        "startup-stats",
+        cl::desc("Print when startup milestones were reached"));
+static cl::opt<bool> PerfCountersOpt(
+        "perf-counters",
+        cl::desc("Count cycles, instructions, branch and cache misses of "
+                 "every evaluation (perf_event_open; toggle with @perf)"));
+static cl::opt<unsigned> EvalRepeat(
+        "eval-repeat", cl::init(1),
+        cl::desc("Measure this many further evaluations of each top-level "
+                 "expression"));
+static cl::opt<unsigned> EvalWarmup(
+        "eval-warmup", cl::init(0),
+        cl::desc("Unmeasured evaluations before the -eval-repeat runs"));
+static cl::opt<unsigned> CompileBudgetMs(
+        "compile-budget-ms", cl::init(0),
+        cl::desc("Stop optimizing an item once compiling it has taken this "
+                 "many milliseconds, and generate its code at -O0"));
+static cl::opt<unsigned> CompileBudgetInsts(
+        "compile-budget-insts", cl::init(0),
+        cl::desc("Compile items of more IR instructions than this without "
+                 "optimization, at -O0"));
+static cl::opt<bool> Watch(
+        "watch",
+        cl::desc("Run the input file, then keep watching it: on every change "
+                 "recompile only what changed and re-evaluate the "
+                 "expressions that depend on it"));
+static cl::opt<unsigned> WatchInterval(
+        "watch-interval", cl::init(200),
+        cl::desc("How often -watch checks the input, in milliseconds"));
+static cl::opt<bool> ProfileOpt(
+        "profile",
+        cl::desc("Sample JIT'd code while it runs and print a flat and "
+                 "caller/callee profile at exit (or with @profile)"));
+static cl::opt<unsigned> ProfileInterval(
+        "profile-interval", cl::init(1000),
+        cl::desc("-profile sampling interval in microseconds of CPU time"));
+enum OptProfileKind { OptSpeed, OptSize, OptMinSize };
+static cl::opt<OptProfileKind> OptProfile(
+        "opt-profile", cl::init(OptSpeed),
+        cl::desc("What compiled code is optimized for"),
+        cl::values(clEnumValN(OptSpeed, "speed", "Run time (default)"),
+                   clEnumValN(OptSize, "size",
+                              "Code size without giving up much speed "
+                              "(-Os); packs code compactly and shares "
+                              "identical definitions"),
+                   clEnumValN(OptMinSize, "min",
+                              "Code size above all (-Oz), likewise")));
+static cl::opt<unsigned> ResultCacheEntries(
+        "result-cache", cl::init(0),
+        cl::desc("Remember the results of up to this many pure top-level "
+                 "expressions and answer repeats without compiling them"));
+static cl::opt<std::string> TraceFilename(
+        "trace",
+        cl::desc("Write a Chrome trace-event timeline of parsing, compilation "
+                 "and evaluation to this file"));
+static cl::opt<unsigned> TraceGranularity(
+        "trace-granularity", cl::init(0),
+        cl::desc("Leave spans shorter than this many microseconds out of "
+                 "the -trace timeline"));
+
+// Every thread that does traced work brackets it with these; the main
+// thread writes the trace instead of finishing.
+static void beginThreadTrace() {
+   if (!TraceFilename.empty())
+      timeTraceProfilerInitialize(TraceGranularity, "llvm_first_lang");
+}
+
+static void endThreadTrace() {
+   if (timeTraceProfilerEnabled())
+      timeTraceProfilerFinishThread();
+}
+
+// Threads that only run JIT'd code (the async executor, the par pool) are
+// sampled from start to end with -profile.
+static void beginSampledThread() {
+   if (Profiler)
+      Profiler->attachThread();
+}
+
+static void endSampledThread() {
+   if (Profiler)
+      Profiler->detachThread();
+}
+
+// Startup milestones, in milliseconds since main() was entered.
+struct StartupTimes {
+    std::chrono::steady_clock::time_point Start;
+    double TargetsReady = 0, JITReady = 0, PreludeReady = 0, FirstResult = 0;
+    const char *Prelude = "none";
+
+    double now() const {
+       return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - Start).count();
+    }
+};
+static StartupTimes Startup;
+static bool ReadingPrelude = false;
+static bool Rescanning = false; // -watch is re-reading the input
+static bool CompilingUnit = false; // several input files
+
+// IR-side memory of an item while it is being compiled; the machine code
+// side is tracked by the JIT's JITMemoryAccounting.
+struct IRUsage {
+    unsigned Instructions = 0;
+    size_t HeapBytes = 0; // heap growth during codegen and optimization
+    std::string Tier = "full"; // or how -compile-budget-* cut it short
+};
+static std::map<std::string, IRUsage> IRUsages;
+static size_t PeakIRHeapBytes = 0;
+static std::atomic<unsigned> BudgetFallbacks{0}; // items over -compile-budget-*
+
 static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
                                               std::unique_ptr<ExprAST> LHS);
 static std::unique_ptr<ExprAST> ParseExpression();
@@ -115,11 +433,14 @@ static std::unique_ptr<ExprAST>  LogError(const char *Str);
 static std::unique_ptr<PrototypeAST>  LogErrorP(const char *Str);
 
 // class and function definition
+class VariableExprAST;
+
 class ExprAST {
 public:
     virtual ~ExprAST() {}
-    virtual Value *codegen() = 0; // not implemented. subclass must
+    virtual Value *codegen(CompilerSession &S) = 0; // not implemented. subclass must
     // implement
+    virtual VariableExprAST *asVariable() { return nullptr; }
 };
 
 
@@ -127,22 +448,30 @@ class NumberExprAST: public ExprAST {
     double Val;
 public:
     NumberExprAST(double Val) : Val(Val) {}
-    Value *codegen() {
+    Value *codegen(CompilerSession &S) {
        //return ConstantFP::get(TheContext, APFloat(Val));
        //return ConstantFP::get(Type::getDoubleTy(TheContext), APFloat(Val));
-       return ConstantFP::get(Type::getDoubleTy(*TheContext), APFloat(Val));
+       return ConstantFP::get(Type::getDoubleTy(*S.TheContext), APFloat(Val));
     }
 };
 
+// Variables are bound to SSA values (arguments, reduction indices) or, if
+// declared with var, to an entry-block alloca holding their current value.
 class VariableExprAST: public ExprAST {
     std::string Name;
 public:
     VariableExprAST(const std::string &Name) : Name(Name) {}
-    Value *codegen() {
-       Value *V = NamedValues[Name];
+    const std::string &getName() const { return Name; }
+    VariableExprAST *asVariable() override { return this; }
+    Value *codegen(CompilerSession &S) {
+       Value *V = S.NamedValues[Name];
        if (!V) {
           LogError("Unknown variable name");
+          return nullptr;
        }
+       if (auto *Slot = dyn_cast<AllocaInst>(V))
+          return S.Builder->CreateLoad(Slot->getAllocatedType(), Slot,
+                                     Name.c_str());
        return V;
     }
 };
@@ -155,29 +484,52 @@ public:
                   std::unique_ptr<ExprAST> LHS,
                   std::unique_ptr<ExprAST> RHS):
                   Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-   Value *codegen() {
-       Value *L = LHS->codegen();
-       Value *R = RHS->codegen();
+   Value *codegen(CompilerSession &S) {
+       if (Op == '=')
+          return codegenAssignment(S);
+
+       Value *L = LHS->codegen(S);
+       Value *R = RHS->codegen(S);
        if (!L || !R)
           return nullptr;
 
        switch (Op) {
           case '+':
-             return Builder->CreateFAdd(L,R, "addtmp");
+             return S.Builder->CreateFAdd(L,R, "addtmp");
           case '-':
-             return Builder->CreateFSub(L,R, "subtmp");
+             return S.Builder->CreateFSub(L,R, "subtmp");
           case '*':
-             return Builder->CreateFMul(L,R, "multmp");
+             return S.Builder->CreateFMul(L,R, "multmp");
           case '<':
-             L = Builder->CreateFCmpULT(L,R, "cmptmp");
+             L = S.Builder->CreateFCmpULT(L,R, "cmptmp");
              // convert bool 0/1 to double 0.0 or 1.0
-             return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
+             return S.Builder->CreateUIToFP(L, Type::getDoubleTy(*S.TheContext),
                                          "booltmp");
           default:
              LogError("invalid binary operator");
              return nullptr;
        }
     }
+
+    // x = e stores e into var-bound x and yields e.
+    Value *codegenAssignment(CompilerSession &S) {
+       VariableExprAST *Dest = LHS->asVariable();
+       if (!Dest) {
+          LogError("Destination of '=' must be a variable");
+          return nullptr;
+       }
+       Value *Val = RHS->codegen(S);
+       if (!Val)
+          return nullptr;
+       auto *Slot =
+               dyn_cast_or_null<AllocaInst>(S.NamedValues[Dest->getName()]);
+       if (!Slot) {
+          LogError("Only var-bound variables can be assigned");
+          return nullptr;
+       }
+       S.Builder->CreateStore(Val, Slot);
+       return Val;
+    }
 };
 
 class CallExprAST: public ExprAST {
@@ -187,9 +539,9 @@ public:
    CallExprAST(const std::string &Callee,
                 std::vector<std::unique_ptr<ExprAST>> Args)
                 : Callee(Callee), Args(std::move(Args)) {}
-   Value *codegen() {
+   Value *codegen(CompilerSession &S) {
        //Function *CalleeF = TheModule->getFunction(Callee);
-      Function *CalleeF = getFunction(Callee);
+      Function *CalleeF = getFunction(S, Callee);
       if (!CalleeF) {
          LogError("Unknown function referenced");
          return nullptr;
@@ -201,15 +553,75 @@ public:
       }
       std::vector<Value *> ArgsV;
       for (auto it = Args.begin(); it != Args.end(); ++it) {
-         ArgsV.push_back((*it)->codegen());
+         ArgsV.push_back((*it)->codegen(S));
          if (!ArgsV.back())
             return nullptr;
       }
 
-      return Builder->CreateCall(CalleeF, ArgsV, "calltmp");
+      return S.Builder->CreateCall(CalleeF, ArgsV, "calltmp");
    }
 };
 
+// ReduceExprAST - Expression class for the reduction builtins
+//   sum i = start, end in body
+// and likewise min, max and count.  The index runs over [start, end) in
+// steps of 1.0.  The loop is emitted with a reassociable accumulator and
+// vectorize/interleave hints so the loop vectorizer turns it into SIMD
+// partial sums (several accumulators) and a horizontal reduction at the end.
+class ReduceExprAST: public ExprAST {
+public:
+    enum ReduceKind { Sum, Min, Max, Count };
+
+private:
+    ReduceKind Kind;
+    std::string VarName;
+    std::unique_ptr<ExprAST> Start, End, Body;
+
+public:
+    ReduceExprAST(ReduceKind Kind, const std::string &VarName,
+                  std::unique_ptr<ExprAST> Start,
+                  std::unique_ptr<ExprAST> End,
+                  std::unique_ptr<ExprAST> Body)
+                  : Kind(Kind), VarName(VarName), Start(std::move(Start)),
+                    End(std::move(End)), Body(std::move(Body)) {}
+    Value *codegen(CompilerSession &S);
+};
+
+// VarExprAST - Expression class for
+//   var x = init, y = init in body
+// Each variable lives in an alloca in the function's entry block, so it can
+// be assigned; mem2reg turns them back into SSA values.
+class VarExprAST: public ExprAST {
+    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> Vars;
+    std::unique_ptr<ExprAST> Body;
+
+public:
+    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>>
+                       Vars,
+               std::unique_ptr<ExprAST> Body)
+               : Vars(std::move(Vars)), Body(std::move(Body)) {}
+    Value *codegen(CompilerSession &S);
+};
+
+// ParExprAST - Expression class for
+//   par(e1, e2, ...)
+// The operands are evaluated as independent tasks, forked onto the
+// work-stealing runtime in ParRuntime.h, and the value is their sum taken
+// in source order. Inside the operands the variables in scope are
+// read-only, so it makes no difference whether they ran in parallel.
+class ParExprAST: public ExprAST {
+    std::vector<std::unique_ptr<ExprAST>> Operands;
+
+public:
+    ParExprAST(std::vector<std::unique_ptr<ExprAST>> Operands)
+               : Operands(std::move(Operands)) {}
+    Value *codegen(CompilerSession &S);
+
+private:
+    Function *outline(CompilerSession &S, ExprAST &Operand,
+                      const std::vector<std::string> &Names);
+};
+
 class PrototypeAST {
     std::string Name;
     std::vector<std::string> Args;
@@ -219,12 +631,14 @@ public:
     : Name(name), Args(std::move(Args)) {}
 
     const std::string &getName() const { return Name; }
-    Function *codegen() {
-       std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(*TheContext));
-       FunctionType *FT = FunctionType::get(Type::getDoubleTy(*TheContext),
+    const std::vector<std::string> &getArgs() const { return Args; }
+    Function *codegen(CompilerSession &S) {
+       std::vector<Type *> Doubles(Args.size(),
+                                   Type::getDoubleTy(*S.TheContext));
+       FunctionType *FT = FunctionType::get(Type::getDoubleTy(*S.TheContext),
                                             Doubles, false);
        Function *F = Function::Create(FT, Function::ExternalLinkage, Name,
-                                      TheModule.get());
+                                      S.TheModule.get());
        unsigned Idx = 0;
        for (auto &Arg : F->args()) {
           Arg.setName(Args[Idx++]);
@@ -234,25 +648,65 @@ public:
 };
 
 // FunctionAST - This class represents a function definition itself.
+// A definition calls others through their lazy stubs, as any of them may
+// be redefined. Its calls to itself, and those of its par operands, need
+// not: those run the body they are part of. Move F's body into an internal
+// fastcc function they call directly, and leave F the C-ABI entry point
+// that the host and other definitions call.
+static void callSelfDirectly(Function &F) {
+   std::vector<CallInst *> SelfCalls;
+   for (User *U : F.users())
+      if (auto *Call = dyn_cast<CallInst>(U))
+         if (Call->getCalledOperand() == &F)
+            SelfCalls.push_back(Call);
+   if (SelfCalls.empty())
+      return;
+
+   Function *Body = Function::Create(F.getFunctionType(),
+                                     Function::InternalLinkage,
+                                     F.getName() + ".self", F.getParent());
+   Body->setCallingConv(CallingConv::Fast);
+   Body->getBasicBlockList().splice(Body->end(), F.getBasicBlockList());
+   std::vector<Value *> Args;
+   for (auto Arg : zip(F.args(), Body->args())) {
+      std::get<1>(Arg).setName(std::get<0>(Arg).getName());
+      std::get<0>(Arg).replaceAllUsesWith(&std::get<1>(Arg));
+      Args.push_back(&std::get<0>(Arg));
+   }
+   for (CallInst *Call : SelfCalls) {
+      Call->setCalledFunction(Body);
+      Call->setCallingConv(CallingConv::Fast);
+   }
+
+   IRBuilder<> Builder(BasicBlock::Create(F.getContext(), "entry", &F));
+   CallInst *Call = Builder.CreateCall(Body, Args);
+   Call->setCallingConv(CallingConv::Fast);
+   Call->setTailCall();
+   Builder.CreateRet(Call);
+}
+
 class FunctionAST {
-    std::unique_ptr<PrototypeAST> Proto;
+    std::shared_ptr<PrototypeAST> Proto;
     std::unique_ptr<ExprAST> Body;
 
 public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
+    FunctionAST(std::shared_ptr<PrototypeAST> Proto,
                 std::unique_ptr<ExprAST> Body)
                 : Proto(std::move(Proto)), Body(std::move(Body)) {}
 
-   Function *codegen() {
+    const std::shared_ptr<PrototypeAST> &getProto() const { return Proto; }
+
+   Function *codegen(CompilerSession &S) {
 
       //Function *TheFunction = TheModule->getFunction(Proto->getName());
 
-      auto Name = Proto->getName();
-      FunctionProtos[Name] = std::move(Proto);
-      Function *TheFunction = getFunction(Name);
+      // Named prototypes were registered by the parser; anonymous
+      // expressions are never looked up and don't need to be.
+      auto &Name = Proto->getName();
+      Function *TheFunction = getFunction(S, Name);
 
       if (!TheFunction) {
-         TheFunction = Proto->codegen();
+         TheFunction = Proto->codegen(S);
 
       }
 
@@ -265,44 +719,484 @@ public:
       //   return nullptr;
       //}
 
-      BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction);
-      Builder->SetInsertPoint(BB);
+      BasicBlock *BB = BasicBlock::Create(*S.TheContext, "entry", TheFunction);
+      S.Builder->SetInsertPoint(BB);
+
+      // Count calls for the JIT's eviction policy. The counter lives in the
+      // host, so it survives the body being evicted and recompiled. par
+      // workers may call the function at once, so the bump is atomic.
+      if (uint64_t *Counter = S.TheJIT->getCallCounter(Name)) {
+         Type *I64 = Type::getInt64Ty(*S.TheContext);
+         Constant *CounterPtr = ConstantExpr::getIntToPtr(
+                 ConstantInt::get(I64, (uint64_t)(uintptr_t)Counter),
+                 I64->getPointerTo());
+         S.Builder->CreateAtomicRMW(AtomicRMWInst::Add, CounterPtr,
+                                    ConstantInt::get(I64, 1), MaybeAlign(8),
+                                    AtomicOrdering::Monotonic);
+      }
 
-      NamedValues.clear();
+      // Bind by the prototype's names: the context may discard value names.
+      S.NamedValues.clear();
+      auto &ArgNames = Proto->getArgs();
+      unsigned Idx = 0;
       for (auto &Arg : TheFunction->args()) {
-         NamedValues[std::string(Arg.getName())] = &Arg;
+         S.NamedValues[ArgNames[Idx++]] = &Arg;
       }
 
-      Value *RetVal = Body->codegen();
+      Value *RetVal = Body->codegen(S);
       if (RetVal) {
          // Finish off the function
-         Builder->CreateRet(RetVal);
+         S.Builder->CreateRet(RetVal);
+         callSelfDirectly(*TheFunction);
 
          // Validate the generated code, checking for consistency
          verifyFunction(*TheFunction);
 
-         // Optimize the function
-         TheFPM->run(*TheFunction);
-
          return TheFunction;
       }
       else {
+         // Any par operands outlined from the body go with it.
+         std::vector<Function *> Dead;
+         for (auto &F : *S.TheModule)
+            if (!F.isDeclaration() && &F != TheFunction)
+               Dead.push_back(&F);
+         for (Function *F : Dead)
+            F->eraseFromParent();
          TheFunction->eraseFromParent();
          return nullptr;
       }
    }
 };
 
-static int CurTok;
+Value *ReduceExprAST::codegen(CompilerSession &S) {
+   Type *DoubleTy = Type::getDoubleTy(*S.TheContext);
+   Type *IndexTy = Type::getInt64Ty(*S.TheContext);
+
+   Value *StartV = Start->codegen(S);
+   Value *EndV = End->codegen(S);
+   if (!StartV || !EndV)
+      return nullptr;
+
+   // trip count = max(ceil(end - start), 0), counted on an integer index so
+   // the loop vectorizer sees a canonical induction variable. A NaN span
+   // runs no iterations, and one beyond 2^62 is clamped rather than left
+   // to an out-of-range (poison) conversion.
+   Value *Span = S.Builder->CreateFSub(EndV, StartV, "span");
+   Span = S.Builder->CreateUnaryIntrinsic(Intrinsic::ceil, Span);
+   Value *HasIter = S.Builder->CreateFCmpOGT(Span,
+                                           ConstantFP::get(DoubleTy, 0.0));
+   Value *MaxSpan = ConstantFP::get(DoubleTy, 4611686018427387904.0);
+   Span = S.Builder->CreateSelect(HasIter,
+                                  S.Builder->CreateMinNum(Span, MaxSpan),
+                                  ConstantFP::get(DoubleTy, 0.0));
+   Value *TripCount = S.Builder->CreateFPToSI(Span, IndexTy, "tripcount");
+   if (AsyncWorkers)
+      HasIter = S.Builder->CreateAnd(HasIter,
+                                     S.Builder->CreateNot(emitCancelled(S)));
+
+   Value *Identity;
+   switch (Kind) {
+      case Min:
+         Identity = ConstantFP::getInfinity(DoubleTy, false);
+         break;
+      case Max:
+         Identity = ConstantFP::getInfinity(DoubleTy, true);
+         break;
+      default:
+         Identity = ConstantFP::get(DoubleTy, 0.0);
+         break;
+   }
+
+   Function *TheFunction = S.Builder->GetInsertBlock()->getParent();
+   BasicBlock *PreheaderBB = S.Builder->GetInsertBlock();
+   BasicBlock *LoopBB =
+           BasicBlock::Create(*S.TheContext, "reduce", TheFunction);
+   BasicBlock *AfterBB = BasicBlock::Create(*S.TheContext, "reduceend");
+   S.Builder->CreateCondBr(HasIter, LoopBB, AfterBB);
+
+   S.Builder->SetInsertPoint(LoopBB);
+   PHINode *Index = S.Builder->CreatePHI(IndexTy, 2, "idx");
+   Index->addIncoming(ConstantInt::get(IndexTy, 0), PreheaderBB);
+   PHINode *Acc = S.Builder->CreatePHI(DoubleTy, 2, "acc");
+   Acc->addIncoming(Identity, PreheaderBB);
+
+   // the index variable shadows any argument of the same name
+   Value *OldVal = S.NamedValues[VarName];
+   S.NamedValues[VarName] = S.Builder->CreateFAdd(
+           StartV, S.Builder->CreateSIToFP(Index, DoubleTy), VarName);
+
+   Value *BodyV = Body->codegen(S);
+   auto RestoreVar = [&] {
+      if (OldVal)
+         S.NamedValues[VarName] = OldVal;
+      else
+         S.NamedValues.erase(VarName);
+   };
+   if (!BodyV) {
+      RestoreVar();
+      return nullptr;
+   }
+
+   Value *NextAcc;
+   {
+   // reassociation is what lets the accumulator be split into partial sums;
+   // min/max additionally need to ignore NaNs and signed zeros.
+   FastMathFlags FMF;
+   FMF.setAllowReassoc();
+   FMF.setNoNaNs();
+   FMF.setNoSignedZeros();
+   IRBuilder<>::FastMathFlagGuard FMFGuard(*S.Builder);
+   S.Builder->setFastMathFlags(FMF);
+
+   switch (Kind) {
+      case Sum:
+         NextAcc = S.Builder->CreateFAdd(Acc, BodyV, "sumtmp");
+         break;
+      case Min:
+         NextAcc = S.Builder->CreateMinNum(Acc, BodyV, "mintmp");
+         break;
+      case Max:
+         NextAcc = S.Builder->CreateMaxNum(Acc, BodyV, "maxtmp");
+         break;
+      case Count: {
+         Value *NonZero = S.Builder->CreateFCmpUNE(
+                 BodyV, ConstantFP::get(DoubleTy, 0.0), "nonzero");
+         NextAcc = S.Builder->CreateFAdd(
+                 Acc, S.Builder->CreateUIToFP(NonZero, DoubleTy), "counttmp");
+         break;
+      }
+   }
+   }
+
+   Value *NextIndex = S.Builder->CreateAdd(Index, ConstantInt::get(IndexTy, 1),
+                                         "nextidx");
+   Value *More = S.Builder->CreateICmpSLT(NextIndex, TripCount, "more");
+
+   // the body may have added blocks of its own (nested reductions)
+   BasicBlock *LoopEndBB = S.Builder->GetInsertBlock();
+   BranchInst *Latch = S.Builder->CreateCondBr(More, LoopBB, AfterBB);
+   Index->addIncoming(NextIndex, LoopEndBB);
+   Acc->addIncoming(NextAcc, LoopEndBB);
+
+   // ask for interleaving, i.e. several independent accumulators; whether
+   // to vectorize is left to the cost model, since forcing it makes every
+   // loop it can't handle (calls, nested control flow) print a remark
+   LLVMContext &Ctx = *S.TheContext;
+   Metadata *Four = ConstantAsMetadata::get(
+           ConstantInt::get(Type::getInt32Ty(Ctx), 4));
+   auto LoopID = MDNode::getDistinct(
+           Ctx, {nullptr,
+                 MDNode::get(Ctx, {MDString::get(Ctx,
+                                                 "llvm.loop.interleave.count"),
+                                   Four})});
+   LoopID->replaceOperandWith(0, LoopID);
+   Latch->setMetadata(LLVMContext::MD_loop, LoopID);
+
+   TheFunction->getBasicBlockList().push_back(AfterBB);
+   S.Builder->SetInsertPoint(AfterBB);
+   PHINode *Result = S.Builder->CreatePHI(DoubleTy, 2, "reducetmp");
+   Result->addIncoming(Identity, PreheaderBB);
+   Result->addIncoming(NextAcc, LoopEndBB);
+
+   RestoreVar();
+   return Result;
+}
+
+// Whether the evaluation running this code has been cancelled (AsyncEval.h).
+// Costs a load and a branch unless some evaluation is being cancelled.
+static Value *emitCancelled(CompilerSession &S) {
+   LLVMContext &Ctx = *S.TheContext;
+   Type *I32 = Type::getInt32Ty(Ctx);
+   LoadInst *Pending = S.Builder->CreateAlignedLoad(
+           I32, S.TheModule->getOrInsertGlobal("mylang.cancel.pending", I32),
+           Align(4), "cancelling");
+   Pending->setAtomic(AtomicOrdering::Unordered);
+
+   Function *TheFunction = S.Builder->GetInsertBlock()->getParent();
+   BasicBlock *EntryBB = S.Builder->GetInsertBlock();
+   BasicBlock *CheckBB = BasicBlock::Create(Ctx, "cancel.check", TheFunction);
+   BasicBlock *ContBB = BasicBlock::Create(Ctx, "cancel.cont", TheFunction);
+   S.Builder->CreateCondBr(
+           S.Builder->CreateICmpNE(Pending, ConstantInt::get(I32, 0)), CheckBB,
+           ContBB, MDBuilder(Ctx).createBranchWeights(1, 1000));
+
+   S.Builder->SetInsertPoint(CheckBB);
+   FunctionCallee CheckF =
+           S.TheModule->getOrInsertFunction("mylang.cancel.check", I32);
+   Value *Mine = S.Builder->CreateICmpNE(S.Builder->CreateCall(CheckF),
+                                         ConstantInt::get(I32, 0));
+   S.Builder->CreateBr(ContBB);
+
+   S.Builder->SetInsertPoint(ContBB);
+   PHINode *Cancelled =
+           S.Builder->CreatePHI(Type::getInt1Ty(Ctx), 2, "cancelled");
+   Cancelled->addIncoming(ConstantInt::getFalse(Ctx), EntryBB);
+   Cancelled->addIncoming(Mine, CheckBB);
+   return Cancelled;
+}
+
+// Allocas go in the entry block, where mem2reg can promote them.
+static AllocaInst *CreateEntryBlockAlloca(CompilerSession &S, Function *F,
+                                          const std::string &Name) {
+   IRBuilder<> TmpB(&F->getEntryBlock(), F->getEntryBlock().begin());
+   return TmpB.CreateAlloca(Type::getDoubleTy(*S.TheContext), nullptr, Name);
+}
+
+Value *VarExprAST::codegen(CompilerSession &S) {
+   Function *TheFunction = S.Builder->GetInsertBlock()->getParent();
+   std::vector<std::pair<std::string, Value *>> Shadowed;
+
+   for (auto &Var : Vars) {
+      // The initializer is evaluated before the variable is in scope, so
+      // var x = x + 1 refers to an outer x.
+      Value *InitVal = Var.second
+                               ? Var.second->codegen(S)
+                               : ConstantFP::get(*S.TheContext, APFloat(0.0));
+      if (!InitVal)
+         return nullptr;
+      AllocaInst *Slot = CreateEntryBlockAlloca(S, TheFunction, Var.first);
+      S.Builder->CreateStore(InitVal, Slot);
+
+      auto Old = S.NamedValues.find(Var.first);
+      Shadowed.push_back(
+              {Var.first, Old == S.NamedValues.end() ? nullptr : Old->second});
+      S.NamedValues[Var.first] = Slot;
+   }
+
+   Value *BodyVal = Body->codegen(S);
+
+   for (auto I = Shadowed.rbegin(); I != Shadowed.rend(); ++I) {
+      if (I->second)
+         S.NamedValues[I->first] = I->second;
+      else
+         S.NamedValues.erase(I->first);
+   }
+   return BodyVal;
+}
+
+Value *ParExprAST::codegen(CompilerSession &S) {
+   LLVMContext &Ctx = *S.TheContext;
+   Type *DoubleTy = Type::getDoubleTy(Ctx);
+   Type *I64 = Type::getInt64Ty(Ctx);
+   Function *TheFunction = S.Builder->GetInsertBlock()->getParent();
+   auto Saved = S.NamedValues;
+
+   // Read var-bound variables once, here; from now on every variable in
+   // scope is a plain value and can't be assigned.
+   std::vector<std::string> Names;
+   std::vector<Value *> Values;
+   for (auto &NV : S.NamedValues) {
+      Value *V = NV.second;
+      if (auto *Slot = dyn_cast<AllocaInst>(V))
+         V = S.Builder->CreateLoad(Slot->getAllocatedType(), Slot, NV.first);
+      Names.push_back(NV.first);
+      Values.push_back(V);
+   }
+
+   // Each operand is compiled once, as a function that reads the variables
+   // from an environment array, and both paths below call those functions.
+   std::vector<Function *> OperandFns;
+   for (auto &Operand : Operands) {
+      Function *F = outline(S, *Operand, Names);
+      if (!F) {
+         S.NamedValues = Saved;
+         return nullptr;
+      }
+      OperandFns.push_back(F);
+   }
+   S.NamedValues = Saved;
+
+   Type *TaskPtrTy = FunctionType::get(DoubleTy, {DoubleTy->getPointerTo()},
+                                       false)->getPointerTo();
+   auto *EnvTy = ArrayType::get(DoubleTy, std::max<size_t>(Names.size(), 1));
+   auto *FnsTy = ArrayType::get(TaskPtrTy, Operands.size());
+   auto *ResultsTy = ArrayType::get(DoubleTy, Operands.size());
+   IRBuilder<> EntryB(&TheFunction->getEntryBlock(),
+                      TheFunction->getEntryBlock().begin());
+   Value *EnvSlot = EntryB.CreateAlloca(EnvTy, nullptr, "par.env");
+   Value *FnsSlot = EntryB.CreateAlloca(FnsTy, nullptr, "par.fns");
+   Value *Results = EntryB.CreateAlloca(ResultsTy, nullptr, "par.results");
+
+   // Stored on each path, after the runtime call that picks it, so that on
+   // the sequential path the loads of inlined operands see the stores.
+   auto StoreEnv = [&] {
+      for (unsigned I = 0; I < Values.size(); ++I)
+         S.Builder->CreateStore(
+                 Values[I],
+                 S.Builder->CreateConstInBoundsGEP2_64(EnvTy, EnvSlot, 0, I));
+      return S.Builder->CreateConstInBoundsGEP2_64(EnvTy, EnvSlot, 0, 0);
+   };
+
+   FunctionCallee ForkF = S.TheModule->getOrInsertFunction(
+           "mylang.par.fork", Type::getInt32Ty(Ctx));
+   Value *Fork = S.Builder->CreateICmpNE(
+           S.Builder->CreateCall(ForkF),
+           ConstantInt::get(Type::getInt32Ty(Ctx), 0), "fork");
+   BasicBlock *SeqBB = BasicBlock::Create(Ctx, "par.seq", TheFunction);
+   BasicBlock *ForkBB = BasicBlock::Create(Ctx, "par.fork");
+   BasicBlock *EndBB = BasicBlock::Create(Ctx, "par.end");
+   S.Builder->CreateCondBr(Fork, ForkBB, SeqBB);
+
+   // Past the sequential cutoff: the operands one after another.
+   S.Builder->SetInsertPoint(SeqBB);
+   Value *Env = StoreEnv();
+   Value *SeqSum = nullptr;
+   std::vector<CallInst *> SeqCalls;
+   for (Function *F : OperandFns) {
+      SeqCalls.push_back(S.Builder->CreateCall(F, {Env}, "partmp"));
+      SeqSum = SeqSum ? S.Builder->CreateFAdd(SeqSum, SeqCalls.back(),
+                                              "partmp")
+                      : SeqCalls.back();
+   }
+   S.Builder->CreateBr(EndBB);
+
+   // Forking: the runtime calls the functions and fills in the results.
+   TheFunction->getBasicBlockList().push_back(ForkBB);
+   S.Builder->SetInsertPoint(ForkBB);
+   Env = StoreEnv();
+   for (unsigned I = 0; I < OperandFns.size(); ++I)
+      S.Builder->CreateStore(
+              OperandFns[I],
+              S.Builder->CreateConstInBoundsGEP2_64(FnsTy, FnsSlot, 0, I));
+
+   FunctionCallee RunF = S.TheModule->getOrInsertFunction(
+           "mylang.par.run", Type::getVoidTy(Ctx), I64,
+           TaskPtrTy->getPointerTo(), DoubleTy->getPointerTo(),
+           DoubleTy->getPointerTo());
+   S.Builder->CreateCall(
+           RunF, {ConstantInt::get(I64, Operands.size()),
+                  S.Builder->CreateConstInBoundsGEP2_64(FnsTy, FnsSlot, 0, 0),
+                  Env,
+                  S.Builder->CreateConstInBoundsGEP2_64(ResultsTy, Results, 0,
+                                                        0)});
+   Value *ForkSum = nullptr;
+   for (unsigned I = 0; I < Operands.size(); ++I) {
+      Value *V = S.Builder->CreateLoad(
+              DoubleTy,
+              S.Builder->CreateConstInBoundsGEP2_64(ResultsTy, Results, 0, I));
+      ForkSum = ForkSum ? S.Builder->CreateFAdd(ForkSum, V, "partmp") : V;
+   }
+   S.Builder->CreateBr(EndBB);
+
+   TheFunction->getBasicBlockList().push_back(EndBB);
+   PHINode *Result = PHINode::Create(DoubleTy, 2, "partmp", EndBB);
+   Result->addIncoming(SeqSum, SeqBB);
+   Result->addIncoming(ForkSum, ForkBB);
+
+   // There is no inliner in the pipeline, and a call per operand is most of
+   // the cost of a small one (fib(n - 1)), so small operands are inlined
+   // into the sequential path here. A copy is at most MaxInlinedParInsts
+   // instructions per operand, however deeply pars nest. Splitting SeqBB
+   // keeps the phi's incoming block up to date.
+   const unsigned MaxInlinedParInsts = 32;
+   for (CallInst *Call : SeqCalls)
+      if (Call->getCalledFunction()->getInstructionCount() <=
+          MaxInlinedParInsts) {
+         InlineFunctionInfo IFI;
+         InlineFunction(*Call, IFI);
+      }
+
+   S.Builder->SetInsertPoint(EndBB);
+   return Result;
+}
+
+// Operand as an internal function double(double *Env), Env holding the
+// values of Names. Leaves S.NamedValues bound to that function's loads.
+Function *ParExprAST::outline(CompilerSession &S, ExprAST &Operand,
+                              const std::vector<std::string> &Names) {
+   Type *DoubleTy = Type::getDoubleTy(*S.TheContext);
+   Function *Parent = S.Builder->GetInsertBlock()->getParent();
+   auto *FT = FunctionType::get(DoubleTy, {DoubleTy->getPointerTo()}, false);
+   Function *F = Function::Create(FT, Function::InternalLinkage,
+                                  Parent->getName() + ".par",
+                                  S.TheModule.get());
+   auto IP = S.Builder->saveIP();
+   S.Builder->SetInsertPoint(BasicBlock::Create(*S.TheContext, "entry", F));
+   Value *Env = F->getArg(0);
+   for (unsigned I = 0; I < Names.size(); ++I)
+      S.NamedValues[Names[I]] = S.Builder->CreateLoad(
+              DoubleTy, S.Builder->CreateConstInBoundsGEP1_64(DoubleTy, Env, I),
+              Names[I]);
+   Value *V = Operand.codegen(S);
+   if (V) {
+      S.Builder->CreateRet(V);
+      verifyFunction(*F);
+   }
+   S.Builder->restoreIP(IP);
+   if (!V) {
+      F->eraseFromParent();
+      return nullptr;
+   }
+   return F;
+}
+
+static thread_local int CurTok;
+
+// While an item is parsed: the tokens it consumes, which make its content
+// hash, and the functions it calls.
+static thread_local std::string *ItemTokens = nullptr;
+static thread_local std::set<std::string> *ItemCallees = nullptr;
+
+// Everything the lexer and parser know about their input, for handing a
+// source over to another thread mid-way (-pipeline).
+struct LexerState {
+   FILE *Input;
+   int LastChar, CurTok;
+   std::string IdentifierStr;
+   double NumVal;
+};
+
+static LexerState saveLexerState() {
+   return {Input, LastChar, CurTok, IdentifierStr, NumVal};
+}
+
+static void restoreLexerState(const LexerState &S) {
+   Input = S.Input;
+   LastChar = S.LastChar;
+   CurTok = S.CurTok;
+   IdentifierStr = S.IdentifierStr;
+   NumVal = S.NumVal;
+}
+
+static void appendToken(std::string &Out) {
+   char Buf[32];
+   switch (CurTok) {
+      case tok_identifier:
+      case tok_command:
+         Out += 'i' + IdentifierStr;
+         break;
+      case tok_number:
+         snprintf(Buf, sizeof(Buf), "n%a", NumVal);
+         Out += Buf;
+         break;
+      default:
+         Out += 't' + std::to_string(CurTok);
+         break;
+   }
+   Out += ' ';
+}
+
 static int getNextToken() {
+   if (ItemTokens)
+      appendToken(*ItemTokens);
    return CurTok = gettok();
 }
 
 static std::unique_ptr<ExprAST>  LogError(const char *Str) {
-   fprintf(stderr, "LogError: %s\n", Str);
+   if (LogSink)
+      *LogSink += std::string("LogError: ") + Str + "\n";
+   else
+      fprintf(stderr, "LogError: %s\n", Str);
    return nullptr;
 }
 
+static void LogNote(const char *Str) {
+   if (LogSink)
+      *LogSink += std::string("note: ") + Str + "\n";
+   else
+      fprintf(stderr, "note: %s\n", Str);
+}
+
 static std::unique_ptr<PrototypeAST>  LogErrorP(const char *Str) {
    LogError(Str);
    return nullptr;
@@ -359,6 +1253,8 @@ static std::unique_ptr<ExprAST> ParseIdentifierOrCallExpr() {
             return LogError("Expected ')' or ',' in argument list");
          }
       }
+      if (ItemCallees)
+         ItemCallees->insert(IdName);
       return std::make_unique<CallExprAST>(IdName, std::move(Args));
    }
    else {
@@ -366,6 +1262,163 @@ static std::unique_ptr<ExprAST> ParseIdentifierOrCallExpr() {
    }
 }
 
+/// reduceexpr ::= ('sum' | 'min' | 'max' | 'count')
+///                identifier '=' expr ',' expr 'in' expression
+static std::unique_ptr<ExprAST> ParseReduceExpr() {
+   ReduceExprAST::ReduceKind Kind;
+   switch (CurTok) {
+      case tok_sum:
+         Kind = ReduceExprAST::Sum;
+         break;
+      case tok_min:
+         Kind = ReduceExprAST::Min;
+         break;
+      case tok_max:
+         Kind = ReduceExprAST::Max;
+         break;
+      default:
+         Kind = ReduceExprAST::Count;
+         break;
+   }
+   getNextToken(); // eat the reduction keyword
+
+   if (CurTok != tok_identifier)
+      return LogError("Expected identifier after reduction keyword");
+   std::string IdName = IdentifierStr;
+   getNextToken();
+
+   if (CurTok != '=')
+      return LogError("Expected '=' after reduction index");
+   getNextToken();
+
+   auto Start = ParseExpression();
+   if (!Start)
+      return nullptr;
+   if (CurTok != ',')
+      return LogError("Expected ',' after reduction start value");
+   getNextToken();
+
+   auto End = ParseExpression();
+   if (!End)
+      return nullptr;
+   if (CurTok != tok_in)
+      return LogError("Expected 'in' after reduction end value");
+   getNextToken();
+
+   auto Body = ParseExpression();
+   if (!Body)
+      return nullptr;
+
+   return std::make_unique<ReduceExprAST>(Kind, IdName, std::move(Start),
+                                          std::move(End), std::move(Body));
+}
+
+/// dotexpr ::= 'dot' '(' identifier ',' identifier ',' expr ')'
+/// dot(x, y, n) is the dot product of the element functions x and y over
+/// [0, n), i.e. sum i = 0, n in x(i) * y(i).
+static std::unique_ptr<ExprAST> ParseDotExpr() {
+   getNextToken(); // eat dot
+   if (CurTok != '(')
+      return LogError("Expected '(' after dot");
+   getNextToken();
+
+   std::string Operands[2];
+   for (auto &Operand : Operands) {
+      if (CurTok != tok_identifier)
+         return LogError("Expected function name in dot");
+      Operand = IdentifierStr;
+      if (ItemCallees)
+         ItemCallees->insert(Operand);
+      getNextToken();
+      if (CurTok != ',')
+         return LogError("Expected ',' in dot");
+      getNextToken();
+   }
+
+   auto N = ParseExpression();
+   if (!N)
+      return nullptr;
+   if (CurTok != ')')
+      return LogError("Expected ')' after dot");
+   getNextToken();
+
+   // '.' cannot appear in a user identifier, so the index never shadows one
+   const std::string IdName = "dot.i";
+   std::unique_ptr<ExprAST> Elems[2];
+   for (int I = 0; I < 2; ++I) {
+      std::vector<std::unique_ptr<ExprAST>> Args;
+      Args.push_back(std::make_unique<VariableExprAST>(IdName));
+      Elems[I] = std::make_unique<CallExprAST>(Operands[I], std::move(Args));
+   }
+   auto Body = std::make_unique<BinaryExprAST>('*', std::move(Elems[0]),
+                                               std::move(Elems[1]));
+   return std::make_unique<ReduceExprAST>(
+           ReduceExprAST::Sum, IdName, std::make_unique<NumberExprAST>(0.0),
+           std::move(N), std::move(Body));
+}
+
+/// varexpr ::= 'var' identifier ('=' expression)?
+///               (',' identifier ('=' expression)?)* 'in' expression
+static std::unique_ptr<ExprAST> ParseVarExpr() {
+   getNextToken(); // eat var
+
+   std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> Vars;
+   if (CurTok != tok_identifier)
+      return LogError("Expected identifier after var");
+   while (true) {
+      std::string Name = IdentifierStr;
+      getNextToken();
+
+      // The initializer is optional; variables start at 0.0.
+      std::unique_ptr<ExprAST> Init;
+      if (CurTok == '=') {
+         getNextToken();
+         Init = ParseExpression();
+         if (!Init)
+            return nullptr;
+      }
+      Vars.push_back({Name, std::move(Init)});
+
+      if (CurTok != ',')
+         break;
+      getNextToken();
+      if (CurTok != tok_identifier)
+         return LogError("Expected identifier list after var");
+   }
+
+   if (CurTok != tok_in)
+      return LogError("Expected 'in' after var");
+   getNextToken();
+
+   auto Body = ParseExpression();
+   if (!Body)
+      return nullptr;
+   return std::make_unique<VarExprAST>(std::move(Vars), std::move(Body));
+}
+
+/// parexpr ::= 'par' '(' expression (',' expression)* ')'
+static std::unique_ptr<ExprAST> ParseParExpr() {
+   getNextToken(); // eat par
+   if (CurTok != '(')
+      return LogError("Expected '(' after par");
+   getNextToken();
+
+   std::vector<std::unique_ptr<ExprAST>> Operands;
+   while (true) {
+      auto Operand = ParseExpression();
+      if (!Operand)
+         return nullptr;
+      Operands.push_back(std::move(Operand));
+      if (CurTok == ')')
+         break;
+      if (CurTok != ',')
+         return LogError("Expected ')' or ',' in par");
+      getNextToken();
+   }
+   getNextToken(); // eat )
+   return std::make_unique<ParExprAST>(std::move(Operands));
+}
+
 static std::unique_ptr<ExprAST> ParsePrimary() {
    switch(CurTok) {
       case tok_identifier:
@@ -374,6 +1427,17 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
          return ParseNumberExpr();
       case '(':
          return ParseParenExpr();
+      case tok_sum:
+      case tok_min:
+      case tok_max:
+      case tok_count:
+         return ParseReduceExpr();
+      case tok_dot:
+         return ParseDotExpr();
+      case tok_var:
+         return ParseVarExpr();
+      case tok_par:
+         return ParseParExpr();
       default:
          return LogError("Unknown token when expecting an expression");
    }
@@ -382,6 +1446,8 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 static int GetTokPrecedence() {
 
    switch(CurTok) {
+      case '=':
+         return 2;
       case '<':
       case '>':
          return 10;
@@ -504,159 +1570,1848 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 // Top-Level parsing and codegen
 //===----------------------------------------------------------------------===//
 
-static void InitializeModulePassManager() {
-   // Open a new context and module.
-   TheContext = std::make_unique<LLVMContext>();
-   TheModule = std::make_unique<Module>("my cool jit", *TheContext);
-   TheModule->setDataLayout(TheJIT->getDataLayout());
+// The function pass pipeline, in order. Kept as factories so the passes can
+// also be created and timed one at a time (bench/mylang_bench.cpp).
+struct FunctionPassInfo {
+   const char *Name;
+   Pass *(*Create)();
+};
 
-   // Create a new builder for the module.
-   Builder = std::make_unique<IRBuilder<>>(*TheContext);
-
-   // Create a new pass manager attached to it.
-   TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
-
-   // Do simple "peephole" optimizations and bit-twiddling optzns.
-   TheFPM->add(createInstructionCombiningPass());
-   // Reassociate expressions.
-   TheFPM->add(createReassociatePass());
-   // Eliminate Common SubExpressions.
-   TheFPM->add(createGVNPass());
-   // Simplify the control flow graph (deleting unreachable blocks, etc).
-   TheFPM->add(createCFGSimplificationPass());
-
-   TheFPM->doInitialization();
-}
-
-static void HandleDefinition() {
-   if (auto FnAST = ParseDefinition()) {
-      if (auto *FnIR = FnAST->codegen()) {
-         fprintf(stderr, "Read function definition:\n");
-         FnIR->print(errs());
-         fprintf(stderr, "\n");
-         ExitOnErr(TheJIT->addModule(
-                 ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
-         InitializeModulePassManager();
-      }
-   } else {
-      // Skip token for error recovery.
-      getNextToken();
+static const std::vector<FunctionPassInfo> &getFunctionPasses() {
+   // The size profiles leave out the vectorizer, whose vector bodies,
+   // runtime checks and scalar epilogues multiply the size of a loop.
+   static const std::vector<FunctionPassInfo> SizePasses = {
+      {"mem2reg", [] { return (Pass *)createPromoteMemoryToRegisterPass(); }},
+      {"instcombine", [] { return (Pass *)createInstructionCombiningPass(); }},
+      {"reassociate", [] { return (Pass *)createReassociatePass(); }},
+      {"gvn", [] { return (Pass *)createGVNPass(); }},
+      {"simplifycfg", [] { return (Pass *)createCFGSimplificationPass(); }},
+   };
+   if (OptProfile != OptSpeed)
+      return SizePasses;
+
+   static const std::vector<FunctionPassInfo> Passes = {
+      // Promote var allocas to SSA values.
+      {"mem2reg", [] { return (Pass *)createPromoteMemoryToRegisterPass(); }},
+      // Do simple "peephole" optimizations and bit-twiddling optzns.
+      {"instcombine", [] { return (Pass *)createInstructionCombiningPass(); }},
+      // Reassociate expressions.
+      {"reassociate", [] { return (Pass *)createReassociatePass(); }},
+      // Eliminate Common SubExpressions.
+      {"gvn", [] { return (Pass *)createGVNPass(); }},
+      // Vectorize reduction loops; needs the target's cost model.
+      {"loop-vectorize", [] { return (Pass *)createLoopVectorizePass(); }},
+      // Clean up after the vectorizer.
+      {"instcombine.2", [] { return (Pass *)createInstructionCombiningPass(); }},
+      // Simplify the control flow graph (deleting unreachable blocks, etc).
+      {"simplifycfg", [] { return (Pass *)createCFGSimplificationPass(); }},
+   };
+   return Passes;
+}
+
+// -compile-budget-ms: when the item being compiled on this thread runs out
+// of time, and after which pass.
+static thread_local std::chrono::steady_clock::time_point CompileDeadline;
+static thread_local const char *BudgetCutAfter = nullptr;
+
+// Compile an over-budget function the cheap way: optimization passes skip
+// optnone functions, and instruction selection uses FastISel for them.
+static void markOptNone(Function &F) {
+   F.removeFnAttr(Attribute::MinSize); // incompatible with optnone
+   F.addFnAttr(Attribute::OptimizeNone);
+   F.addFnAttr(Attribute::NoInline);
+}
+
+// Runs after each pass of a budgeted pipeline. Once the deadline has
+// passed it marks the function optnone, so the remaining passes and the
+// JIT's code generator don't spend more time on it. A pass that is already
+// running can't be interrupted; one slow pass is the most an item can
+// overrun its budget by.
+class CompileBudgetCheck : public FunctionPass {
+   const char *After;
+
+public:
+   static char ID;
+   explicit CompileBudgetCheck(const char *After)
+           : FunctionPass(ID), After(After) {}
+
+   bool runOnFunction(Function &F) override {
+      if (F.hasOptNone() || std::chrono::steady_clock::now() < CompileDeadline)
+         return false;
+      markOptNone(F);
+      BudgetCutAfter = After;
+      return true;
+   }
+
+   void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.setPreservesAll();
    }
+
+   StringRef getPassName() const override { return "Compile budget check"; }
+};
+char CompileBudgetCheck::ID = 0;
+
+// Open a new context and module.
+static void InitializeModule(CompilerSession &S) {
+   S.TheContext = std::make_unique<LLVMContext>();
+   // Nobody reads the IR in batch mode, so don't pay for addtmp & co.
+   S.TheContext->setDiscardValueNames(Batch);
+   S.TheModule = std::make_unique<Module>("my cool jit", *S.TheContext);
+   S.TheModule->setDataLayout(S.TheJIT->getDataLayout());
+
+   // Create a new builder for the module.
+   S.Builder = std::make_unique<IRBuilder<>>(*S.TheContext);
 }
 
-static void HandleExtern() {
-   if (auto ProtoAST = ParseExtern()) {
-      if (auto *FnIR = ProtoAST->codegen()) {
-         fprintf(stderr, "Read extern: \n");
-         FnIR->print(errs());
-         fprintf(stderr, "\n");
-         FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
-      }
-   } else {
-      // Skip token for error recovery.
-      getNextToken();
+// Create a function pass manager for the session's module running \p
+// Passes, after the target's cost model (vector widths etc), with a
+// CompileBudgetCheck after each pass if \p Budgeted.
+static std::unique_ptr<legacy::FunctionPassManager>
+createFunctionPassManager(CompilerSession &S,
+                          ArrayRef<FunctionPassInfo> Passes,
+                          bool Budgeted = false) {
+   auto FPM = std::make_unique<legacy::FunctionPassManager>(S.TheModule.get());
+   if (!S.TheTM)
+      S.TheTM = ExitOnErr(S.TheJIT->createTargetMachine());
+   FPM->add(createTargetTransformInfoWrapperPass(
+           S.TheTM->getTargetIRAnalysis()));
+   for (auto &P : Passes) {
+      FPM->add(P.Create());
+      if (Budgeted)
+         FPM->add(new CompileBudgetCheck(P.Name));
    }
+   FPM->doInitialization();
+   return FPM;
 }
 
-static void HandleTopLevelExpression() {
-   // Evaluate a top-level expression into an anonymous function.
-   if (auto FnAST = ParseTopLevelExpr()) {
-      if (auto *FnIR = FnAST->codegen()) {
-         fprintf(stderr, "Read top-level expression: \n");
-         FnIR->print(errs());
-         fprintf(stderr, "\n");
+static void InitializeModulePassManager(CompilerSession &S) {
+   InitializeModule(S);
+   S.TheFPM =
+           createFunctionPassManager(S, getFunctionPasses(), CompileBudgetMs);
+}
 
-         // Create a ResourceTracker to track JIT'd memory allocated to our
-         // anonymous expression -- that way we can free it after executing.
-         auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+static void FinalizeModulePassManager(CompilerSession &S) {
+   S.TheFPM.reset();
+   S.Builder.reset();
+   S.TheModule.reset();
+   S.TheContext.reset();
+   S.TheTM.reset();
+}
 
-         auto TSM = ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-         ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-         InitializeModulePassManager();
+static void addPrototype(CompilerSession &S, unsigned Item,
+                         std::shared_ptr<PrototypeAST> Proto) {
+   std::lock_guard<std::mutex> Lock(S.Decls->ProtosMutex);
+   auto &Versions = S.Decls->FunctionProtos[Proto->getName()];
+   Versions.push_back({Item, std::move(Proto)});
+
+   // Items before NextCommitItem are compiled already, so of the versions
+   // they declared only the newest one can still be found.
+   unsigned Oldest = S.Decls->NextCommitItem;
+   auto Live = std::find_if(Versions.rbegin(), Versions.rend(),
+                            [&](const ProtoVersion &V) {
+                               return V.Item < Oldest;
+                            });
+   if (Live != Versions.rend())
+      Versions.erase(Versions.begin(), std::prev(Live.base()));
+}
+
+static void removePrototype(CompilerSession &S, unsigned Item,
+                            const std::string &Name) {
+   std::lock_guard<std::mutex> Lock(S.Decls->ProtosMutex);
+   auto &Versions = S.Decls->FunctionProtos[Name];
+   Versions.erase(std::remove_if(Versions.begin(), Versions.end(),
+                                 [&](const ProtoVersion &V) {
+                                    return V.Item == Item;
+                                 }),
+                  Versions.end());
+}
+
+// The newest prototype of Name visible to the item being compiled.
+static std::shared_ptr<PrototypeAST> findPrototype(CompilerSession &S,
+                                                   const std::string &Name) {
+   std::lock_guard<std::mutex> Lock(S.Decls->ProtosMutex);
+   auto FI = S.Decls->FunctionProtos.find(Name);
+   if (FI == S.Decls->FunctionProtos.end())
+      return nullptr;
+   for (auto V = FI->second.rbegin(); V != FI->second.rend(); ++V)
+      if (V->Item <= S.CurItem)
+         return V->Proto;
+   return nullptr;
+}
+
+// Bytes of heap in use; the delta across codegen approximates the IR and
+// LLVMContext memory an item needs while it is compiled. With -pipeline
+// the other threads' allocations blur it.
+static size_t heapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+   return mallinfo2().uordblks;
+#else
+   return 0;
+#endif
+}
 
-         // Search the JIT for the __anon_expr symbol.
-         auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
+static IRUsage measureIRUsage(Function *F, size_t HeapBefore) {
+   IRUsage U;
+   U.Instructions = F->getInstructionCount();
+   size_t HeapAfter = heapInUse();
+   U.HeapBytes = HeapAfter > HeapBefore ? HeapAfter - HeapBefore : 0;
+   return U;
+}
 
-         // Get the symbol's address and cast it to the right type (takes no
-         // arguments, returns a double) so we can call it as a native function.
-         double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-         fprintf(stderr, "Evaluated to %f\n", FP());
+static void recordIRUsage(const std::string &Name, const IRUsage &U) {
+   PeakIRHeapBytes = std::max(PeakIRHeapBytes, U.HeapBytes);
+   IRUsages[Name] = U;
+}
 
-         // Delete the anonymous expression module from the JIT.
-         ExitOnErr(RT->remove());
+static void PrintPrompt() {
+   if (!Batch && !Pipeline && !ReadingPrelude && !Rescanning &&
+       !CompilingUnit)
+      fprintf(stderr, "ready> ");
+}
+
+static void DumpIR(const char *What, Function *F) {
+   if (Batch || ReadingPrelude)
+      return;
+   if (LogSink) {
+      raw_string_ostream OS(*LogSink);
+      OS << What << *F << "\n";
+      return;
+   }
+   fprintf(stderr, "%s", What);
+   F->print(errs());
+   fprintf(stderr, "\n");
+}
+
+// A top-level item on its way from the parser to the JIT. Items are
+// numbered in source order; they may be compiled in any order but are
+// always committed to the JIT in that order.
+struct TopLevelItem {
+   enum ItemKind { Definition, Extern, Expression, Command, Invalid };
+   ItemKind Kind = Invalid;
+   unsigned Seq = 0;
+   std::unique_ptr<FunctionAST> FnAST;  // Definition, Expression
+   std::shared_ptr<PrototypeAST> Proto; // Extern
+   std::string CommandName;
+   unsigned CommandArg = 0;             // @await/@poll/@cancel n; 0: all
+   std::string Name;                    // compiled function
+   ThreadSafeModule TSM;                // set once compiled
+   IRUsage IR;
+   std::string Log;                     // deferred output (-pipeline)
+   uint64_t Hash = 0;                   // of the item's tokens
+   std::string Tokens;                  // normalized (expressions only)
+   std::set<std::string> Callees;       // functions the item calls
+   bool CacheCandidate = false;         // not compiled: may be cached
+   uint64_t Fingerprint = 0;            // of the optimized body (-opt-profile)
+};
+
+// Definitions whose optimized IR is the same but for the names of the
+// function and its values compile to the same code, which the JIT can
+// then share. Calls still name their callees, so a recursive function only
+// matches another that calls it in the same places.
+static uint64_t bodyFingerprint(Function &F) {
+   std::vector<std::pair<Value *, std::string>> Names;
+   auto Strip = [&](Value &V) {
+      if (V.hasName()) {
+         Names.push_back({&V, V.getName().str()});
+         V.setName("");
+      }
+   };
+   // The functions outlined for par operands are part of the body too.
+   std::vector<Function *> Fns{&F};
+   for (auto &G : *F.getParent())
+      if (&G != &F && !G.isDeclaration())
+         Fns.push_back(&G);
+   for (Function *G : Fns) {
+      Strip(*G);
+      for (auto &Arg : G->args())
+         Strip(Arg);
+      for (auto &BB : *G) {
+         Strip(BB);
+         for (auto &I : BB)
+            Strip(I);
       }
-   } else {
-      // Skip token for error recovery.
-      getNextToken();
    }
+   std::string Text;
+   raw_string_ostream OS(Text);
+   for (Function *G : Fns)
+      G->print(OS);
+   for (auto &N : Names)
+      N.first->setName(N.second);
+   return xxHash64(OS.str());
 }
 
-/// top ::= definition | external | expression | ';'
-static void MainLoop() {
+// How an item's spans are labelled in -trace timelines.
+static std::string traceDetail(const TopLevelItem &Item) {
+   std::string Name = Item.Name;
+   if (Name.empty() && Item.FnAST)
+      Name = Item.FnAST->getProto()->getName();
+   else if (Name.empty() && Item.Proto)
+      Name = Item.Proto->getName();
+   return Name + " #" + std::to_string(Item.Seq);
+}
+
+/// top ::= definition | external | expression | command | ';'
+/// The item is not numbered yet, see ParseItem.
+static std::unique_ptr<TopLevelItem> ReadItem() {
    while (true) {
-      fprintf(stderr, "ready> ");
+      PrintPrompt();
+      auto Item = std::make_unique<TopLevelItem>();
+      std::string Tokens;
+      struct Capture {
+         Capture(std::string &Tokens, std::set<std::string> &Callees) {
+            ItemTokens = &Tokens;
+            ItemCallees = &Callees;
+         }
+         ~Capture() {
+            ItemTokens = nullptr;
+            ItemCallees = nullptr;
+         }
+      } CaptureItem(Tokens, Item->Callees);
       switch (CurTok) {
          case tok_eof:
-            return;
+            return nullptr;
          case ';': // ignore top-level semicolons.
             getNextToken();
-         break;
+            continue;
          case tok_def:
-            HandleDefinition();
+            if (auto FnAST = ParseDefinition()) {
+               Item->Kind = TopLevelItem::Definition;
+               Item->FnAST = std::move(FnAST);
+            } else {
+               // Skip token for error recovery.
+               getNextToken();
+            }
             break;
          case tok_extern:
-            HandleExtern();
+            if (auto ProtoAST = ParseExtern()) {
+               Item->Kind = TopLevelItem::Extern;
+               Item->Proto = std::move(ProtoAST);
+            } else {
+               // Skip token for error recovery.
+               getNextToken();
+            }
+            break;
+         case tok_command:
+            Item->Kind = TopLevelItem::Command;
+            Item->CommandName = IdentifierStr;
+            if ((Item->CommandName == "await" || Item->CommandName == "poll" ||
+                 Item->CommandName == "cancel") &&
+                numberFollowsOnLine()) {
+               getNextToken(); // eat the command
+               Item->CommandArg = (unsigned)NumVal;
+            }
+            getNextToken(); // eat the command or its argument
             break;
          default:
-            HandleTopLevelExpression();
+            // Evaluate a top-level expression into an anonymous function.
+            if (auto FnAST = ParseTopLevelExpr()) {
+               Item->Kind = TopLevelItem::Expression;
+               Item->FnAST = std::move(FnAST);
+            } else {
+               // Skip token for error recovery.
+               getNextToken();
+            }
             break;
       }
+
+      Item->Hash = xxHash64(Tokens);
+      if (Item->Kind == TopLevelItem::Expression)
+         Item->Tokens = std::move(Tokens);
+      return Item;
    }
 }
 
-Function *getFunction(std::string Name) {
-    // First, see if the function has already been added to the current module.
-    if (auto *F = TheModule->getFunction(Name))
-        return F;
+// Number an item and declare what it defines. Declarations take effect in
+// source order, whenever the items that use them get compiled.
+static void declareItem(CompilerSession &S, TopLevelItem &Item) {
+   Item.Seq = S.Decls->NextItemSeq++;
+   if (Item.Kind == TopLevelItem::Definition)
+      addPrototype(S, Item.Seq, Item.FnAST->getProto());
+   else if (Item.Kind == TopLevelItem::Extern)
+      addPrototype(S, Item.Seq, Item.Proto);
+}
 
-    // If not, check whether we can codegen the declaration from some existing
-    // prototype.
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+static std::unique_ptr<TopLevelItem> ParseItem(CompilerSession &S) {
+   std::unique_ptr<TopLevelItem> Item;
+   {
+      TimeTraceScope Scope("parse", [&] {
+         return "#" + std::to_string(S.Decls->NextItemSeq);
+      });
+      Item = ReadItem();
+   }
+   if (Item)
+      declareItem(S, *Item);
+   return Item;
+}
 
-    // If no existing prototype exists, return null.
-    return nullptr;
+// -result-cache, below.
+static bool mayHaveCachedResult(const TopLevelItem &Item);
+static void cacheResult(uint64_t Hash, const std::string &Tokens,
+                        const std::set<std::string> &Callees, double Result);
+static void PrintResultCacheUsage();
+
+// Codegen and optimize an item into a module of its own.
+static void CompileItem(CompilerSession &S, TopLevelItem &Item) {
+   S.CurItem = std::max(Item.Seq, S.Decls->UnitLastItem);
+   switch (Item.Kind) {
+      case TopLevelItem::Expression:
+         // Whether the cached result is still valid is only known when the
+         // item is committed; it is compiled then if not.
+         if (!Item.CacheCandidate && mayHaveCachedResult(Item)) {
+            Item.CacheCandidate = true;
+            break;
+         }
+         LLVM_FALLTHROUGH;
+      case TopLevelItem::Definition: {
+         phase_stats::CompileTimer CompileTime;
+         auto Start = std::chrono::steady_clock::now();
+         CompileDeadline = Start + std::chrono::milliseconds(CompileBudgetMs);
+         BudgetCutAfter = nullptr;
+         size_t HeapBefore = heapInUse();
+         Function *FnIR;
+         {
+            TimeTraceScope Scope("codegen", [&] { return traceDetail(Item); });
+            FnIR = Item.FnAST->codegen(S);
+         }
+         if (FnIR) {
+            // FnIR, its body if it calls itself, and the par operands
+            // outlined from it.
+            std::vector<Function *> Fns;
+            for (auto &F : *S.TheModule)
+               if (!F.isDeclaration())
+                  Fns.push_back(&F);
+            unsigned Insts = 0;
+            for (Function *F : Fns) {
+               // The profiler finds callers by walking frame pointers.
+               if (Profiler)
+                  F->addFnAttr("frame-pointer", "all");
+               // The passes and the code generator read the size profiles
+               // from these.
+               if (OptProfile != OptSpeed)
+                  F->addFnAttr(Attribute::OptimizeForSize);
+               if (OptProfile == OptMinSize)
+                  F->addFnAttr(Attribute::MinSize);
+               Insts += F->getInstructionCount();
+            }
+            // Over either budget, stop optimizing and fall back to -O0.
+            std::string Tier = "full";
+            if (CompileBudgetInsts && Insts > CompileBudgetInsts) {
+               for (Function *F : Fns)
+                  markOptNone(*F);
+               Tier = "O0 (" + std::to_string(Insts) + " insts)";
+            } else if (CompileBudgetMs &&
+                       std::chrono::steady_clock::now() >= CompileDeadline) {
+               for (Function *F : Fns)
+                  markOptNone(*F);
+               Tier = "O0 after codegen";
+            } else {
+               TimeTraceScope Scope("optimize",
+                                    [&] { return traceDetail(Item); });
+               for (Function *F : Fns)
+                  S.TheFPM->run(*F);
+               if (BudgetCutAfter)
+                  Tier = std::string("O0 after ") + BudgetCutAfter;
+            }
+            Item.IR = measureIRUsage(FnIR, HeapBefore);
+            Item.IR.Tier = Tier;
+            // Several expressions can be in the JIT at once (-async-workers).
+            if (Item.Kind == TopLevelItem::Expression)
+               FnIR->setName("__anon_expr." + std::to_string(Item.Seq));
+            Item.Name = std::string(FnIR->getName());
+            if (OptProfile != OptSpeed &&
+                Item.Kind == TopLevelItem::Definition)
+               Item.Fingerprint = bodyFingerprint(*FnIR);
+            if (Tier != "full") {
+               ++BudgetFallbacks;
+               std::string Note;
+               raw_string_ostream OS(Note);
+               OS << "compile budget: " << traceDetail(Item) << " compiled "
+                  << Tier << format(", %.1f ms",
+                                    std::chrono::duration<double, std::milli>(
+                                            std::chrono::steady_clock::now() -
+                                            Start).count());
+               LogNote(OS.str().c_str());
+            }
+            DumpIR(Item.Kind == TopLevelItem::Definition
+                           ? "Read function definition:\n"
+                           : "Read top-level expression: \n",
+                   FnIR);
+            for (Function *F : Fns)
+               if (F != FnIR)
+                  DumpIR(F->getName().endswith(".self")
+                                 ? "Body it calls itself through:\n"
+                                 : "Outlined par operand:\n",
+                         F);
+            Item.TSM = ThreadSafeModule(std::move(S.TheModule),
+                                        std::move(S.TheContext));
+            InitializeModulePassManager(S);
+         }
+         break;
+      }
+      case TopLevelItem::Extern:
+         if (auto *FnIR = Item.Proto->codegen(S))
+            DumpIR("Read extern: \n", FnIR);
+         break;
+      default:
+         break;
+   }
+}
+
+static bool CountEvaluations = false;      // -perf-counters, @perf
+static std::unique_ptr<PerfCounters> Counters; // opened on first use
+
+// Evaluate FP again for -eval-repeat/-perf-counters and report per-run
+// means. The evaluation that printed the result has already compiled what
+// FP calls, so only steady-state code is measured.
+static void MeasureEvaluation(double (*FP)(), const char *Label = "perf") {
+   SamplingProfiler::Scope Sampling(Profiler);
+   for (unsigned I = 0; I < EvalWarmup; ++I)
+      FP();
+
+   if (CountEvaluations && !Counters)
+      Counters = std::make_unique<PerfCounters>();
+   PerfCounters *PC = CountEvaluations ? Counters.get() : nullptr;
+   unsigned Runs = std::max(1u, (unsigned)EvalRepeat);
+
+   auto T0 = std::chrono::steady_clock::now();
+   if (PC)
+      PC->start();
+   for (unsigned I = 0; I < Runs; ++I)
+      FP();
+   if (PC)
+      PC->stop();
+   auto T1 = std::chrono::steady_clock::now();
+
+   std::string Report;
+   raw_string_ostream OS(Report);
+   OS << Label << ": " << Runs << (Runs == 1 ? " run" : " runs")
+      << ", per run: "
+      << format("%.1f ns",
+                std::chrono::duration<double, std::nano>(T1 - T0).count() /
+                        Runs);
+   if (PC) {
+      for (int C = 0; C < PerfCounters::NumCounters; ++C) {
+         auto Counter = (PerfCounters::Counter)C;
+         OS << ", " << PerfCounters::getName(Counter) << " ";
+         if (PC->isAvailable(Counter))
+            OS << format("%.1f", double(PC->read(Counter)) / Runs);
+         else
+            OS << "n/a";
+      }
+      if (PC->isAvailable(PerfCounters::Cycles) &&
+          PC->isAvailable(PerfCounters::Instructions) &&
+          PC->read(PerfCounters::Cycles))
+         OS << format(" (%.2f IPC)",
+                      double(PC->read(PerfCounters::Instructions)) /
+                              PC->read(PerfCounters::Cycles));
+   }
+   fprintf(stderr, "%s\n", OS.str().c_str());
+}
+
+// Handle numbers the evaluation under -async-workers.
+static void PrintResult(double Result, unsigned Handle = 0) {
+   if (Batch)
+      printf("%.17g\n", Result);
+   else if (Handle)
+      fprintf(stderr, "#%u evaluated to %f\n", Handle, Result);
+   else
+      fprintf(stderr, "Evaluated to %f\n", Result);
+   if (!Startup.FirstResult)
+      Startup.FirstResult = Startup.now();
 }
 
 //===----------------------------------------------------------------------===//
-// Main driver code.
+// Asynchronous evaluation (-async-workers)
+//===----------------------------------------------------------------------===//
+
+// Set up by main() with -async-workers.
+static std::unique_ptr<async_eval::Executor> AsyncExecutor;
+
+// An expression's result on its way out. Results print in source order,
+// so one that is in early waits for those before it.
+struct PendingResult {
+   unsigned Handle;
+   std::shared_ptr<async_eval::Job> Job; // null if answered already
+   double Value;                         // the answer, without a Job
+   ResourceTrackerSP RT;                 // the expression's code
+   uint64_t Hash;                        // for the result cache
+   std::string Tokens;
+   std::set<std::string> Callees;
+};
+static std::deque<PendingResult> PendingResults;
+static unsigned NextHandle = 1;
+static unsigned AsyncEvaluated = 0, AsyncCancelled = 0;
+
+// Print the results at the front of PendingResults that are in, first
+// waiting for those with handles up to Through.
+static void drainResults(unsigned Through = 0) {
+   while (!PendingResults.empty()) {
+      PendingResult &P = PendingResults.front();
+      if (P.Job) {
+         if (P.Handle <= Through)
+            P.Job->wait();
+         else if (!P.Job->finished())
+            break;
+         if (P.Job->status() == async_eval::Job::Done) {
+            PrintResult(P.Job->result(), P.Handle);
+            cacheResult(P.Hash, P.Tokens, P.Callees, P.Job->result());
+            ++AsyncEvaluated;
+         } else {
+            LogNote(("#" + std::to_string(P.Handle) + " cancelled").c_str());
+            ++AsyncCancelled;
+         }
+         ExitOnErr(P.RT->remove());
+      } else
+         PrintResult(P.Value, P.Handle);
+      PendingResults.pop_front();
+   }
+}
+
+// A result known at commit time, e.g. from the result cache.
+static void deliverResult(double Result) {
+   unsigned Handle = AsyncExecutor ? NextHandle++ : 0;
+   if (PendingResults.empty())
+      PrintResult(Result, Handle);
+   else
+      PendingResults.push_back({Handle, nullptr, Result, nullptr, 0, {}, {}});
+}
+
+static void pollResults(unsigned Handle) {
+   drainResults();
+   bool Found = false;
+   for (auto &P : PendingResults) {
+      if (Handle && P.Handle != Handle)
+         continue;
+      Found = true;
+      const char *Status = "done";
+      if (P.Job)
+         switch (P.Job->status()) {
+            case async_eval::Job::Queued:
+               Status = "queued";
+               break;
+            case async_eval::Job::Running:
+               Status = "running";
+               break;
+            case async_eval::Job::Cancelled:
+               Status = "cancelled";
+               break;
+            default:
+               break;
+         }
+      fprintf(stderr, "#%u %s\n", P.Handle, Status);
+   }
+   if (Handle && !Found) {
+      if (Handle < NextHandle)
+         fprintf(stderr, "#%u done\n", Handle);
+      else
+         LogError(("No evaluation #" + std::to_string(Handle)).c_str());
+   } else if (!Found)
+      fprintf(stderr, "no evaluations pending\n");
+}
+
+static void cancelResults(unsigned Handle) {
+   for (auto &P : PendingResults)
+      if (P.Job && (!Handle || P.Handle == Handle))
+         P.Job->cancel();
+   drainResults();
+}
+
+static void EvaluateExpression(CompilerSession &S, TopLevelItem &Item) {
+   // Create a ResourceTracker to track JIT'd memory allocated to our
+   // anonymous expression -- that way we can free it after executing.
+   auto RT = S.TheJIT->getMainJITDylib().createResourceTracker();
+
+   if (auto Err = S.TheJIT->addModule(std::move(Item.TSM), RT)) {
+      logAllUnhandledErrors(std::move(Err), errs(), "LogError: ");
+      return;
+   }
+
+   // Search the JIT for the expression's symbol.
+   auto ExprSymbol = S.TheJIT->lookup(Item.Name);
+   if (!ExprSymbol) {
+      logAllUnhandledErrors(ExprSymbol.takeError(), errs(), "LogError: ");
+      ExitOnErr(RT->remove());
+      return;
+   }
+
+   // Get the symbol's address and cast it to the right type (takes no
+   // arguments, returns a double) so we can call it as a native function.
+   double (*FP)() = (double (*)())(intptr_t)ExprSymbol->getAddress();
+   if (AsyncExecutor) {
+      // No -eval-repeat, @perf or hot layout here: those run the code
+      // again or move it while nothing else may run.
+      unsigned Handle = NextHandle++;
+      std::string Detail = traceDetail(Item);
+      auto Job = AsyncExecutor->submit([FP, Detail] {
+         TimeTraceScope Scope("evaluate", Detail);
+         phase_stats::EvalTimer EvalTime;
+         return FP();
+      });
+      PendingResults.push_back(
+              {Handle, std::move(Job), 0, RT, Item.Hash, Item.Tokens,
+               Item.Callees});
+      if (!Batch)
+         fprintf(stderr, "Evaluating as #%u\n", Handle);
+      return;
+   }
+   double Result;
+   {
+      TimeTraceScope Scope("evaluate", [&] { return traceDetail(Item); });
+      SamplingProfiler::Scope Sampling(Profiler);
+      phase_stats::EvalTimer EvalTime;
+      Result = FP();
+   }
+   PrintResult(Result);
+   cacheResult(Item.Hash, Item.Tokens, Item.Callees, Result);
+   if (CountEvaluations || EvalRepeat > 1)
+      MeasureEvaluation(FP);
+
+   // Move what this evaluation made hot into the hot zone, and measure
+   // again to show what that did (iTLB and L1i misses in particular).
+   auto Layout = ExitOnErr(S.TheJIT->layoutHotDefinitions());
+   if (Layout.MovedIn || Layout.MovedOut) {
+      std::string Note;
+      raw_string_ostream OS(Note);
+      OS << "layout: " << Layout.MovedIn
+         << (Layout.MovedIn == 1 ? " definition (" : " definitions (")
+         << Layout.Bytes << " bytes) moved into the hot zone, "
+         << Layout.MovedOut << " out";
+      LogNote(OS.str().c_str());
+      if (CountEvaluations || EvalRepeat > 1)
+         MeasureEvaluation(FP, "perf after layout");
+   }
+
+   // Delete the anonymous expression module from the JIT.
+   ExitOnErr(RT->remove());
+
+   // Evaluation may have compiled new code; get back under budget
+   // while nothing JIT'd is running.
+   ExitOnErr(S.TheJIT->evictColdDefinitions());
+}
+
+static void PrintMemoryUsage(CompilerSession &S) {
+   auto &Acct = S.TheJIT->getMemoryAccounting();
+   fprintf(stderr, "%-24s %10s %10s %10s %10s %10s  %s\n", "definition",
+           "code", "rodata", "rwdata", "ir-insts", "ir-heap", "tier");
+   Acct.forEachObject([&](const JITMemoryAccounting::ObjectUsage &U) {
+      IRUsage IR;
+      // Bodies are "<name>.impl", or "<name>.impl.<n>" when shared.
+      StringRef Name = StringRef(U.Name).split(".impl").first;
+      auto I = IRUsages.find(std::string(Name));
+      if (I != IRUsages.end())
+         IR = I->second;
+      fprintf(stderr, "%-24s %10llu %10llu %10llu %10u %10zu  %s%s\n",
+              U.Name.c_str(), (unsigned long long)U.Mem.Code,
+              (unsigned long long)U.Mem.ROData,
+              (unsigned long long)U.Mem.RWData, IR.Instructions,
+              IR.HeapBytes, IR.Tier.c_str(),
+              S.TheJIT->isHot(Name) ? ", hot" : "");
+   });
+   for (auto &M : S.TheJIT->getMergedDefinitions())
+      fprintf(stderr, "%-24s %10s  shares %s\n", M.first.c_str(), "-",
+              M.second.c_str());
+   auto Session = Acct.getSessionUsage();
+   fprintf(stderr, "%-24s %10llu %10llu %10llu %10s %10zu\n", "session",
+           (unsigned long long)Session.Code,
+           (unsigned long long)Session.ROData,
+           (unsigned long long)Session.RWData, "", PeakIRHeapBytes);
+   if (auto *Arena = S.TheJIT->getCodeArena())
+      fprintf(stderr,
+              "code arena: %llu of %llu bytes in use; %u definitions "
+              "merged; hot zone %llu of %llu bytes in use, huge pages %s\n",
+              (unsigned long long)Arena->getInUse(),
+              (unsigned long long)Arena->getMapped(),
+              S.TheJIT->getMergedCount(),
+              (unsigned long long)Arena->getHotInUse(),
+              (unsigned long long)Arena->getHotSize(),
+              CodeArena::getHugePageMode().c_str());
+   if (CompileBudgetMs || CompileBudgetInsts)
+      fprintf(stderr, "compile budget %u ms, %u insts: %u items at -O0\n",
+              (unsigned)CompileBudgetMs, (unsigned)CompileBudgetInsts,
+              BudgetFallbacks.load());
+   if (ResultCacheEntries)
+      PrintResultCacheUsage();
+   if (SpeculateDepth) {
+      auto Spec = S.TheJIT->getSpeculationStats();
+      fprintf(stderr,
+              "speculation: %u queued, %u compiled ahead: %u hits, %u late, "
+              "%u wasted, %u not called yet\n",
+              Spec.Queued, Spec.Compiled, Spec.Hits, Spec.Late, Spec.Wasted,
+              Spec.Pending);
+   }
+   auto Par = par_runtime::Scheduler::get().stats();
+   if (Par.Forks)
+      fprintf(stderr,
+              "par: %u workers, cutoff %u: %llu forks, %llu tasks, %llu "
+              "stolen\n",
+              par_runtime::Scheduler::get().workers(),
+              par_runtime::Scheduler::get().cutoff(),
+              (unsigned long long)Par.Forks, (unsigned long long)Par.Tasks,
+              (unsigned long long)Par.Stolen);
+   if (AsyncExecutor)
+      fprintf(stderr,
+              "async: %u workers: %u evaluated, %u cancelled, %zu pending\n",
+              (unsigned)AsyncWorkers, AsyncEvaluated, AsyncCancelled,
+              PendingResults.size());
+   if (S.TheJIT->getCodeBudget())
+      fprintf(stderr, "budget %llu bytes: %u evictions, %u recompiles\n",
+              (unsigned long long)S.TheJIT->getCodeBudget(),
+              S.TheJIT->getEvictionCount(), S.TheJIT->getRecompileCount());
+}
+
+// The live version of every definition: its content hash, its arity and
+// what it calls. Callers reach a definition through its stub and are only
+// compiled against its prototype; nothing is inlined across definitions.
+struct DefinitionInfo {
+   uint64_t Hash = 0;
+   unsigned Arity = 0;
+   unsigned Version = 0; // bumped whenever the name is (re)defined
+   std::set<std::string> Callees;
+};
+static std::map<std::string, DefinitionInfo> Dependencies;
+
+static void recordDependencies(const TopLevelItem &Item) {
+   auto &Info = Dependencies[Item.Name];
+   ++Info.Version;
+   Info.Hash = Item.Hash;
+   Info.Arity = Item.FnAST->getProto()->getArgs().size();
+   Info.Callees = Item.Callees;
+}
+
+// Whether calling Callees can run any of Targets, directly or indirectly.
+static bool reachesAny(const std::set<std::string> &Callees,
+                       const std::set<std::string> &Targets) {
+   std::set<std::string> Seen;
+   std::vector<std::string> Work(Callees.begin(), Callees.end());
+   while (!Work.empty()) {
+      std::string Name = Work.back();
+      Work.pop_back();
+      if (!Seen.insert(Name).second)
+         continue;
+      if (Targets.count(Name))
+         return true;
+      auto I = Dependencies.find(Name);
+      if (I != Dependencies.end())
+         Work.insert(Work.end(), I->second.Callees.begin(),
+                     I->second.Callees.end());
+   }
+   return false;
+}
+
+static void PrintDependencies() {
+   std::map<std::string, std::set<std::string>> Callers;
+   for (auto &KV : Dependencies)
+      for (auto &Callee : KV.second.Callees)
+         Callers[Callee].insert(KV.first);
+   for (auto &KV : Dependencies) {
+      fprintf(stderr, "%s/%u calls:", KV.first.c_str(), KV.second.Arity);
+      for (auto &Callee : KV.second.Callees)
+         fprintf(stderr, " %s", Callee.c_str());
+      fprintf(stderr, "; called by:");
+      for (auto &Caller : Callers[KV.first])
+         fprintf(stderr, " %s", Caller.c_str());
+      fprintf(stderr, "\n");
+   }
+}
+
+//===----------------------------------------------------------------------===//
+// -result-cache: results of pure top-level expressions
+//===----------------------------------------------------------------------===//
+
+// Results are keyed by the expression's token hash, so spacing, comments
+// and the spelling of numbers don't matter, and are valid for as long as
+// every definition the expression can reach is still at the version it was
+// evaluated against. Only the commit thread validates and fills the cache;
+// -pipeline workers just check whether an entry exists.
+struct CachedResult {
+   double Value;
+   std::string Tokens; // the expression, in case hashes collide
+   std::vector<std::pair<std::string, unsigned>> Versions;
+};
+static std::map<uint64_t, CachedResult> ResultCache;
+static std::deque<uint64_t> ResultCacheOrder; // oldest first, for eviction
+static std::mutex ResultCacheMutex;
+static unsigned ResultCacheHits = 0;
+static unsigned ResultCacheMisses = 0; // pure expressions evaluated
+static unsigned ResultCacheInvalidations = 0;
+
+// libm functions without side effects or state, as far as results go.
+static bool isPureLibraryFunction(const std::string &Name) {
+   static const std::set<std::string> Pure = {
+           "sin",  "cos",   "tan",   "asin",  "acos",  "atan",  "atan2",
+           "sinh", "cosh",  "tanh",  "exp",   "exp2",  "expm1", "log",
+           "log2", "log10", "log1p", "pow",   "sqrt",  "cbrt",  "fabs",
+           "floor", "ceil", "round", "trunc", "fmod",  "fmin",  "fmax",
+           "hypot", "copysign"};
+   return Pure.count(Name);
+}
+
+// The live version of every definition reachable from Callees. False if
+// any of them is an extern other than a pure library function, or was not
+// compiled in this session (prelude snapshots), whose purity is unknown.
+static bool collectVersions(const std::set<std::string> &Callees,
+                            std::vector<std::pair<std::string, unsigned>> &Out) {
+   std::set<std::string> Seen;
+   std::vector<std::string> Work(Callees.begin(), Callees.end());
+   while (!Work.empty()) {
+      std::string Name = Work.back();
+      Work.pop_back();
+      if (!Seen.insert(Name).second)
+         continue;
+      auto I = Dependencies.find(Name);
+      if (I == Dependencies.end()) {
+         if (!isPureLibraryFunction(Name))
+            return false;
+         continue;
+      }
+      Out.push_back({Name, I->second.Version});
+      Work.insert(Work.end(), I->second.Callees.begin(),
+                  I->second.Callees.end());
+   }
+   return true;
+}
+
+// Measuring evaluations means running them.
+static bool resultCacheEnabled() {
+   return ResultCacheEntries && !CountEvaluations && EvalRepeat <= 1 &&
+          !Profiler;
+}
+
+static bool mayHaveCachedResult(const TopLevelItem &Item) {
+   if (!ResultCacheEntries)
+      return false;
+   std::lock_guard<std::mutex> Lock(ResultCacheMutex);
+   auto I = ResultCache.find(Item.Hash);
+   return I != ResultCache.end() && I->second.Tokens == Item.Tokens;
+}
+
+// Print the cached result of Item, if there is a valid one.
+static bool answerFromCache(const TopLevelItem &Item) {
+   if (!resultCacheEnabled())
+      return false;
+   std::unique_lock<std::mutex> Lock(ResultCacheMutex);
+   auto I = ResultCache.find(Item.Hash);
+   if (I == ResultCache.end() || I->second.Tokens != Item.Tokens)
+      return false;
+   for (auto &V : I->second.Versions) {
+      auto D = Dependencies.find(V.first);
+      if (D == Dependencies.end() || D->second.Version != V.second) {
+         ResultCache.erase(I);
+         ++ResultCacheInvalidations;
+         return false;
+      }
+   }
+   ++ResultCacheHits;
+   double Result = I->second.Value;
+   Lock.unlock();
+   deliverResult(Result);
+   return true;
+}
+
+static void cacheResult(uint64_t Hash, const std::string &Tokens,
+                        const std::set<std::string> &Callees, double Result) {
+   if (!resultCacheEnabled())
+      return;
+   CachedResult Entry{Result, Tokens, {}};
+   if (!collectVersions(Callees, Entry.Versions))
+      return;
+   std::lock_guard<std::mutex> Lock(ResultCacheMutex);
+   ++ResultCacheMisses;
+   if (!ResultCache.count(Hash))
+      ResultCacheOrder.push_back(Hash);
+   ResultCache[Hash] = std::move(Entry);
+   // Invalidated entries leave stale hashes behind in the order; skip them.
+   while (ResultCache.size() > ResultCacheEntries) {
+      ResultCache.erase(ResultCacheOrder.front());
+      ResultCacheOrder.pop_front();
+   }
+}
+
+static void PrintResultCacheUsage() {
+   std::lock_guard<std::mutex> Lock(ResultCacheMutex);
+   fprintf(stderr,
+           "result cache: %zu of %u entries, %u hits, %u misses, %u "
+           "invalidated\n",
+           ResultCache.size(), (unsigned)ResultCacheEntries, ResultCacheHits,
+           ResultCacheMisses, ResultCacheInvalidations);
+}
+
+/// command ::= '@' identifier
+// Arg is the handle for @await, @poll and @cancel, 0 meaning all.
+static void HandleCommand(CompilerSession &S, const std::string &Command,
+                          unsigned Arg) {
+   if (Command == "mem")
+      PrintMemoryUsage(S);
+   else if (Command == "deps")
+      PrintDependencies();
+   else if (Command == "perf") {
+      CountEvaluations = !CountEvaluations;
+      if (CountEvaluations && !Counters)
+         Counters = std::make_unique<PerfCounters>();
+      fprintf(stderr, "perf counters %s%s\n", CountEvaluations ? "on" : "off",
+              CountEvaluations && !Counters->anyAvailable()
+                      ? " (none available: check perf_event_paranoid)"
+                      : "");
+   } else if (Command == "await")
+      drainResults(Arg ? Arg : ~0u);
+   else if (Command == "poll")
+      pollResults(Arg);
+   else if (Command == "cancel")
+      cancelResults(Arg);
+   else if (Command == "profile") {
+      if (Profiler)
+         Profiler->print(errs());
+      else
+         LogError("@profile needs -profile");
+   } else
+      LogError(("Unknown command @" + Command).c_str());
+}
+
+// Hand a compiled item to the JIT, evaluating it if it is an expression.
+static void CommitItem(CompilerSession &S, TopLevelItem &Item) {
+   drainResults();
+   if (!Item.Log.empty())
+      fputs(Item.Log.c_str(), stderr);
+
+   switch (Item.Kind) {
+      case TopLevelItem::Definition:
+         if (!Item.TSM.getModuleUnlocked())
+            break;
+         // Defining a name again releases its old body, which evaluations
+         // still running may be in.
+         if (!PendingResults.empty() && S.TheJIT->isDefined(Item.Name))
+            drainResults(~0u);
+         recordIRUsage(Item.Name, Item.IR);
+         if (auto Err = S.TheJIT->addDefinition(Item.Name, std::move(Item.TSM),
+                                              Item.Fingerprint)) {
+            logAllUnhandledErrors(std::move(Err), errs(), "LogError: ");
+            removePrototype(S, Item.Seq, Item.Name);
+         } else
+            recordDependencies(Item);
+         break;
+      case TopLevelItem::Expression:
+         // -pipeline workers may have compiled the item before its result
+         // was cached; evaluating it can still be skipped.
+         if (answerFromCache(Item))
+            break;
+         if (Item.CacheCandidate)
+            CompileItem(S, Item);
+         if (!Item.TSM.getModuleUnlocked())
+            break;
+         recordIRUsage(Item.Name, Item.IR);
+         EvaluateExpression(S, Item);
+         break;
+      case TopLevelItem::Command:
+         HandleCommand(S, Item.CommandName, Item.CommandArg);
+         break;
+      default:
+         break;
+   }
+   S.Decls->NextCommitItem = Item.Seq + 1;
+}
+
+// First is an item parsed ahead of time, if any.
+static void MainLoop(CompilerSession &S,
+                     std::unique_ptr<TopLevelItem> First = nullptr) {
+   for (auto Item = First ? std::move(First) : ParseItem(S); Item;
+        Item = ParseItem(S)) {
+      CompileItem(S, *Item);
+      CommitItem(S, *Item);
+   }
+}
+
+// PipelinedMainLoop - MainLoop with the stages overlapped: the parser reads
+// ahead on its own thread, a pool of workers codegens and optimizes items,
+// and the calling thread commits them to the JIT in source order. At most
+// PipelineDepth items are in flight.
+static void PipelinedMainLoop(CompilerSession &S) {
+   std::mutex M;
+   std::condition_variable ParsedCV, DoneCV, WindowCV;
+   std::deque<std::unique_ptr<TopLevelItem>> Parsed;
+   std::map<unsigned, std::unique_ptr<TopLevelItem>> Done;
+   const unsigned First = S.Decls->NextItemSeq;
+   unsigned NextCommit = First, End = ~0u;
+   bool ParserDone = false;
+
+   // The calling thread has read the first token already.
+   LexerState Lexer = saveLexerState();
+   std::thread Parser([&] {
+      beginThreadTrace();
+      restoreLexerState(Lexer);
+      while (true) {
+         std::string Log;
+         LogSink = &Log;
+         auto Item = ParseItem(S);
+         LogSink = nullptr;
+
+         std::unique_lock<std::mutex> Lock(M);
+         if (!Item) {
+            ParserDone = true;
+            End = S.Decls->NextItemSeq;
+            ParsedCV.notify_all();
+            DoneCV.notify_all();
+            endThreadTrace();
+            return;
+         }
+         Item->Log = std::move(Log);
+         WindowCV.wait(Lock, [&] {
+            return Item->Seq < NextCommit + PipelineDepth;
+         });
+         Parsed.push_back(std::move(Item));
+         ParsedCV.notify_one();
+      }
+   });
+
+   std::vector<std::thread> Workers;
+   for (unsigned I = 0; I < std::max(1u, (unsigned)PipelineWorkers); ++I)
+      Workers.emplace_back([&] {
+         beginThreadTrace();
+         auto Worker = S.createWorker();
+         InitializeModulePassManager(*Worker);
+         while (true) {
+            std::unique_ptr<TopLevelItem> Item;
+            {
+               std::unique_lock<std::mutex> Lock(M);
+               ParsedCV.wait(Lock, [&] {
+                  return !Parsed.empty() || ParserDone;
+               });
+               if (Parsed.empty())
+                  break;
+               Item = std::move(Parsed.front());
+               Parsed.pop_front();
+            }
+
+            LogSink = &Item->Log;
+            CompileItem(*Worker, *Item);
+            LogSink = nullptr;
+
+            std::lock_guard<std::mutex> Lock(M);
+            unsigned Seq = Item->Seq;
+            Done[Seq] = std::move(Item);
+            DoneCV.notify_all();
+         }
+         FinalizeModulePassManager(*Worker);
+         endThreadTrace();
+      });
+
+   for (unsigned Seq = First;; ++Seq) {
+      std::unique_ptr<TopLevelItem> Item;
+      {
+         std::unique_lock<std::mutex> Lock(M);
+         DoneCV.wait(Lock, [&] { return Done.count(Seq) || Seq >= End; });
+         if (!Done.count(Seq))
+            break;
+         Item = std::move(Done[Seq]);
+         Done.erase(Seq);
+      }
+
+      CommitItem(S, *Item);
+
+      std::lock_guard<std::mutex> Lock(M);
+      NextCommit = Seq + 1;
+      WindowCV.notify_all();
+   }
+
+   Parser.join();
+   for (auto &W : Workers)
+      W.join();
+}
+
+//===----------------------------------------------------------------------===//
+// Units: several input files compiled together
 //===----------------------------------------------------------------------===//
 
-int main() {
+// With several input files (or a directory of .k files) the files are one
+// program. Workers parse whole files concurrently, each with its own lexer
+// and parser state; the unit's declarations are then shared, so any file
+// can call what any other defines; the workers codegen and optimize their
+// files' items concurrently, each item into a context of its own; and the
+// calling thread commits every definition to the JIT, in file order, before
+// it evaluates the expressions and runs the commands, again in file order.
+
+struct UnitFile {
+   std::string Path;
+   std::vector<std::unique_ptr<TopLevelItem>> Items;
+   std::string Log; // what parsing it reported
+   double ParseMs = 0, CompileMs = 0;
+   unsigned Definitions = 0;
+   bool Opened = true;
+};
+
+// Path itself, or the .k files in it, sorted, if it is a directory.
+static void addUnitInputs(const std::string &Path,
+                          std::vector<UnitFile> &Files) {
+   if (!sys::fs::is_directory(Path)) {
+      Files.emplace_back();
+      Files.back().Path = Path;
+      return;
+   }
+   std::vector<std::string> Found;
+   std::error_code EC;
+   for (sys::fs::directory_iterator I(Path, EC), E; I != E && !EC;
+        I.increment(EC))
+      if (StringRef(I->path()).endswith(".k"))
+         Found.push_back(I->path());
+   std::sort(Found.begin(), Found.end());
+   for (auto &F : Found) {
+      Files.emplace_back();
+      Files.back().Path = F;
+   }
+}
+
+// Run Fn on every file, Workers at a time, each file on one thread.
+template <typename FnT>
+static void forEachUnitFile(std::vector<UnitFile> &Files, unsigned Workers,
+                            FnT Fn) {
+   std::atomic<size_t> Next{0};
+   std::vector<std::thread> Threads;
+   for (unsigned I = 0; I < std::min<size_t>(Workers, Files.size()); ++I)
+      Threads.emplace_back([&] {
+         beginThreadTrace();
+         for (size_t F; (F = Next++) < Files.size();)
+            Fn(Files[F]);
+         endThreadTrace();
+      });
+   for (auto &T : Threads)
+      T.join();
+}
+
+static double msSince(std::chrono::steady_clock::time_point Start) {
+   return std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - Start).count();
+}
+
+static void UnitMainLoop(CompilerSession &S, std::vector<UnitFile> &Files) {
+   unsigned Workers = UnitWorkers ? (unsigned)UnitWorkers
+                                  : std::max(1u, std::thread::hardware_concurrency());
+   CompilingUnit = true;
+
+   auto Start = std::chrono::steady_clock::now();
+   forEachUnitFile(Files, Workers, [](UnitFile &File) {
+      auto T0 = std::chrono::steady_clock::now();
+      FILE *F = fopen(File.Path.c_str(), "r");
+      if (!F) {
+         File.Opened = false;
+         return;
+      }
+      setLexerInput(F);
+      LogSink = &File.Log;
+      getNextToken();
+      while (auto Item = ReadItem()) {
+         if (!File.Log.empty())
+            Item->Log = File.Path + ":\n" + File.Log;
+         File.Log.clear();
+         File.Items.push_back(std::move(Item));
+      }
+      LogSink = nullptr;
+      fclose(F);
+      File.ParseMs = msSince(T0);
+   });
+   double ParseMs = msSince(Start);
+
+   for (auto &File : Files) {
+      if (!File.Opened)
+         fprintf(stderr, "Cannot open %s\n", File.Path.c_str());
+      else if (!File.Log.empty())
+         fprintf(stderr, "%s:\n%s", File.Path.c_str(), File.Log.c_str());
+      for (auto &Item : File.Items)
+         declareItem(S, *Item);
+   }
+   S.Decls->UnitLastItem = S.Decls->NextItemSeq ? S.Decls->NextItemSeq - 1 : 0;
+
+   Start = std::chrono::steady_clock::now();
+   forEachUnitFile(Files, Workers, [&](UnitFile &File) {
+      auto T0 = std::chrono::steady_clock::now();
+      auto Worker = S.createWorker();
+      InitializeModulePassManager(*Worker);
+      for (auto &Item : File.Items) {
+         LogSink = &Item->Log;
+         CompileItem(*Worker, *Item);
+         LogSink = nullptr;
+         File.Definitions += Item->Kind == TopLevelItem::Definition;
+      }
+      FinalizeModulePassManager(*Worker);
+      File.CompileMs = msSince(T0);
+   });
+   double CompileMs = msSince(Start);
+
+   // Definitions first, so expressions can call into any file.
+   for (auto &File : Files)
+      for (auto &Item : File.Items)
+         if (Item->Kind == TopLevelItem::Definition ||
+             Item->Kind == TopLevelItem::Extern)
+            CommitItem(S, *Item);
+   for (auto &File : Files)
+      for (auto &Item : File.Items)
+         if (Item->Kind != TopLevelItem::Definition &&
+             Item->Kind != TopLevelItem::Extern)
+            CommitItem(S, *Item);
+   S.Decls->NextCommitItem = S.Decls->NextItemSeq;
+
+   double FileParseMs = 0, FileCompileMs = 0;
+   fprintf(stderr, "%-32s %6s %6s %10s %10s\n", "file", "items", "defs",
+           "parse ms", "compile ms");
+   for (auto &File : Files) {
+      fprintf(stderr, "%-32s %6zu %6u %10.2f %10.2f\n", File.Path.c_str(),
+              File.Items.size(), File.Definitions, File.ParseMs,
+              File.CompileMs);
+      FileParseMs += File.ParseMs;
+      FileCompileMs += File.CompileMs;
+   }
+   fprintf(stderr,
+           "unit: %zu files on %u workers, parse %.2f ms (%.2f ms of work), "
+           "compile %.2f ms (%.2f ms of work)\n",
+           Files.size(), Workers, ParseMs, FileParseMs, CompileMs,
+           FileCompileMs);
+   CompilingUnit = false;
+}
+
+//===----------------------------------------------------------------------===//
+// -watch: incremental recompilation
+//===----------------------------------------------------------------------===//
 
-   InitializeNativeTarget();
-   InitializeNativeTargetAsmPrinter();
-   InitializeNativeTargetAsmParser();
+// What the previous run of the watched file compiled and evaluated.
+// Definitions are identified by name and occurrence, since a file may
+// redefine a function; expressions only by their content.
+struct WatchedVersion {
+   std::map<std::pair<std::string, unsigned>, uint64_t> Definitions;
+   std::multiset<uint64_t> Expressions;
+};
 
-   // Prime the first token.
-   fprintf(stderr, "ready> ");
+// Run a new version of the watched file against the live session. A
+// definition is recompiled if it changed, if the live body of its name is
+// a different occurrence (redefinitions), or if a function it calls changed
+// arity. An expression is evaluated if it is new or can reach a recompiled
+// definition. Everything else is skipped, and the swapped-in bodies are
+// picked up through the existing stubs.
+static void runWatchedSource(CompilerSession &S, StringRef Source,
+                             WatchedVersion &Live,
+                             bool Report) {
+   auto Start = std::chrono::steady_clock::now();
+   FILE *F = fmemopen((void *)Source.data(), Source.size(), "r");
+   FILE *SavedInput = Input;
+   setLexerInput(F);
+   Rescanning = true;
    getNextToken();
 
-   TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
-   //InitializeModulePassManager();
-   InitializeModulePassManager();
+   WatchedVersion Next;
+   std::map<std::string, unsigned> Occurrences;
+   std::set<std::string> Recompiled, ArityChanged;
+   unsigned Changed = 0, Dependents = 0, Evaluated = 0, Skipped = 0;
+   while (auto Item = ParseItem(S)) {
+      bool Run = false;
+      switch (Item->Kind) {
+         case TopLevelItem::Definition: {
+            auto &Proto = *Item->FnAST->getProto();
+            const std::string &Name = Proto.getName();
+            auto Key = std::make_pair(Name, ++Occurrences[Name]);
+            Next.Definitions[Key] = Item->Hash;
+            auto Old = Live.Definitions.find(Key);
+            auto Info = Dependencies.find(Name);
+            if (Old == Live.Definitions.end() || Old->second != Item->Hash) {
+               Run = true;
+               ++Changed;
+            } else if (Info == Dependencies.end() ||
+                       Info->second.Hash != Item->Hash ||
+                       reachesAny(Item->Callees, ArityChanged)) {
+               Run = true;
+               ++Dependents;
+            }
+            if (Run) {
+               if (Info != Dependencies.end() &&
+                   Info->second.Arity != Proto.getArgs().size())
+                  ArityChanged.insert(Name);
+               Recompiled.insert(Name);
+            }
+            break;
+         }
+         case TopLevelItem::Expression: {
+            Next.Expressions.insert(Item->Hash);
+            auto Old = Live.Expressions.find(Item->Hash);
+            if (Old == Live.Expressions.end())
+               Run = true;
+            else {
+               Live.Expressions.erase(Old);
+               Run = reachesAny(Item->Callees, Recompiled);
+            }
+            Evaluated += Run;
+            break;
+         }
+         case TopLevelItem::Extern:
+            Run = true;
+            break;
+         default:
+            // Commands are for interactive use; don't repeat them.
+            break;
+      }
+      if (Run) {
+         CompileItem(S, *Item);
+         CommitItem(S, *Item);
+      } else {
+         Skipped += Item->Kind == TopLevelItem::Definition;
+         S.Decls->NextCommitItem = Item->Seq + 1;
+      }
+   }
+   Live = std::move(Next);
+
+   Rescanning = false;
+   fclose(F);
+   setLexerInput(SavedInput);
+   if (Report)
+      fprintf(stderr,
+              "watch: %u changed, %u dependent and %u unchanged definitions, "
+              "%u expressions evaluated in %.1f ms\n",
+              Changed, Dependents, Skipped, Evaluated,
+              std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - Start).count());
+}
 
-   // Run the main "interpreter loop" now.
-   MainLoop();
-   TheModule->print(errs(),nullptr);
-   return 0;
+// Run the input file, then poll it and rerun it incrementally whenever it
+// has changed and stayed unchanged for a whole interval (so half-written
+// saves are not picked up). Never returns.
+static void WatchLoop(CompilerSession &S, const std::string &InputFilename) {
+   WatchedVersion Live;
+   sys::TimePoint<> Modified;
+   uint64_t Size = 0;
+   bool First = true, Pending = false;
+   while (true) {
+      sys::fs::file_status Status;
+      if (!sys::fs::status(InputFilename, Status)) {
+         bool Changed = First || Status.getLastModificationTime() != Modified ||
+                        Status.getSize() != Size;
+         Modified = Status.getLastModificationTime();
+         Size = Status.getSize();
+         if (Changed && !First)
+            Pending = true; // wait until it has settled
+         else if (First || Pending) {
+            if (auto Buf = MemoryBuffer::getFile(InputFilename)) {
+               runWatchedSource(S, (*Buf)->getBuffer(), Live, !First);
+               fflush(stdout);
+            }
+            First = Pending = false;
+         }
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(WatchInterval));
+   }
 }
 
+//===----------------------------------------------------------------------===//
+// Prelude and prelude snapshots
+//===----------------------------------------------------------------------===//
+
+// A prelude snapshot is what reading the prelude leaves behind: the
+// prototypes it declares and the object code of its definitions. It is only
+// valid for the prelude source, host CPU and compiler it was made with,
+// which the key covers. Layout, little endian, str = u32 length + bytes:
+//   "MYLPRLD1" u64:key
+//   u32:#protos  { str:name u32:#args { str:arg } }
+//   u32:#objects { str:name u64:size <pad to 16> bytes }
+static const char SnapshotMagic[] = "MYLPRLD1";
+
+struct PreludeObject {
+   std::string Name;
+   std::unique_ptr<MemoryBuffer> Object;
+};
 
+struct PreludeSnapshotData {
+   std::vector<std::shared_ptr<PrototypeAST>> Protos;
+   std::vector<PreludeObject> Objects;
+};
 
+// Keeps the mapped snapshot alive; its objects are linked lazily.
+static std::unique_ptr<sys::fs::mapped_file_region> PreludeMapping;
 
+static bool usePreludeSnapshot() {
+   // With a code budget or a hot zone, definitions embed the address of
+   // their call counter, which is only good for this process.
+   return !PreludeSnapshot.empty() && !JITCodeBudget && !JITHotZone;
+}
 
+static uint64_t preludeSnapshotKey(StringRef Source) {
+   std::string Key;
+   raw_string_ostream OS(Key);
+   OS << Source << '\0' << LLVM_VERSION_STRING << '\0'
+      << sys::getProcessTriple() << '\0' << sys::getHostCPUName() << '\0';
+   StringMap<bool> HostFeatures;
+   std::vector<std::string> Features;
+   if (sys::getHostCPUFeatures(HostFeatures))
+      for (auto &F : HostFeatures)
+         Features.push_back((F.second ? "+" : "-") + F.first().str());
+   llvm::sort(Features);
+   for (auto &F : Features)
+      OS << F << ',';
+   for (auto &P : getFunctionPasses())
+      OS << P.Name << ',';
+   OS << CompileBudgetMs << ',' << CompileBudgetInsts << ',' << OptProfile
+      << ',' << (AsyncWorkers != 0) << ',' << JITHotZone << ','
+      << JITHotCalls;
+   return xxHash64(OS.str());
+}
 
+static void writePreludeSnapshot(StringRef Path, uint64_t Key,
+                                 const PreludeSnapshotData &Data) {
+   SmallVector<char, 0> Buf;
+   raw_svector_ostream OS(Buf);
+   auto U32 = [&](uint32_t V) { support::endian::write(OS, V, support::little); };
+   auto U64 = [&](uint64_t V) { support::endian::write(OS, V, support::little); };
+   auto Str = [&](StringRef S) {
+      U32(S.size());
+      OS << S;
+   };
+
+   OS.write(SnapshotMagic, 8);
+   U64(Key);
+   U32(Data.Protos.size());
+   for (auto &P : Data.Protos) {
+      Str(P->getName());
+      U32(P->getArgs().size());
+      for (auto &Arg : P->getArgs())
+         Str(Arg);
+   }
+   U32(Data.Objects.size());
+   for (auto &O : Data.Objects) {
+      Str(O.Name);
+      U64(O.Object->getBufferSize());
+      OS.write_zeros(offsetToAlignment(Buf.size(), Align(16)));
+      OS << O.Object->getBuffer();
+   }
 
+   // Write and rename, so readers never see half a snapshot.
+   std::string Tmp = (Path + ".tmp").str();
+   std::error_code EC;
+   {
+      raw_fd_ostream Out(Tmp, EC);
+      if (!EC)
+         Out.write(Buf.data(), Buf.size());
+   }
+   if (!EC)
+      EC = sys::fs::rename(Tmp, Path);
+   if (EC)
+      fprintf(stderr, "Cannot write prelude snapshot %s: %s\n",
+              Path.str().c_str(), EC.message().c_str());
+}
 
+// Map the snapshot at Path and, if it is valid for Key, register its
+// prototypes and return its objects, which point into the mapping.
+static bool mapPreludeSnapshot(CompilerSession &S, StringRef Path,
+                               uint64_t Key,
+                               std::vector<PreludeObject> &Objects) {
+   auto FD = sys::fs::openNativeFileForRead(Path);
+   if (!FD) {
+      consumeError(FD.takeError());
+      return false;
+   }
+   sys::fs::file_status Status;
+   std::error_code EC = sys::fs::status(*FD, Status);
+   if (!EC && Status.getSize())
+      PreludeMapping = std::make_unique<sys::fs::mapped_file_region>(
+              *FD, sys::fs::mapped_file_region::readonly, Status.getSize(), 0,
+              EC);
+   sys::fs::closeFile(*FD);
+   if (EC || !PreludeMapping) {
+      PreludeMapping.reset();
+      return false;
+   }
+
+   const char *Pos = PreludeMapping->const_data();
+   const char *End = Pos + PreludeMapping->size();
+   bool Ok = true;
+   auto Bytes = [&](uint64_t N) {
+      if (!Ok || uint64_t(End - Pos) < N) {
+         Ok = false;
+         return StringRef();
+      }
+      StringRef S(Pos, N);
+      Pos += N;
+      return S;
+   };
+   auto U32 = [&] {
+      StringRef S = Bytes(4);
+      return Ok ? support::endian::read32le(S.data()) : 0;
+   };
+   auto U64 = [&] {
+      StringRef S = Bytes(8);
+      return Ok ? support::endian::read64le(S.data()) : 0;
+   };
+   auto Str = [&] { return Bytes(U32()); };
+
+   if (Bytes(8) != StringRef(SnapshotMagic, 8) || U64() != Key) {
+      PreludeMapping.reset();
+      return false;
+   }
+   std::vector<std::shared_ptr<PrototypeAST>> Protos;
+   for (uint32_t I = 0, N = U32(); Ok && I < N; ++I) {
+      std::string Name = Str().str();
+      std::vector<std::string> Args;
+      for (uint32_t A = 0, NA = U32(); Ok && A < NA; ++A)
+         Args.push_back(Str().str());
+      Protos.push_back(std::make_shared<PrototypeAST>(Name, std::move(Args)));
+   }
+   for (uint32_t I = 0, N = U32(); Ok && I < N; ++I) {
+      std::string Name = Str().str();
+      uint64_t Size = U64();
+      Bytes(offsetToAlignment(Pos - PreludeMapping->const_data(), Align(16)));
+      StringRef Obj = Bytes(Size);
+      Objects.push_back(
+              {Name, MemoryBuffer::getMemBuffer(Obj, Name, false)});
+   }
+   if (!Ok) {
+      fprintf(stderr, "Ignoring truncated prelude snapshot %s\n",
+              Path.str().c_str());
+      Objects.clear();
+      PreludeMapping.reset();
+      return false;
+   }
+
+   for (auto &P : Protos)
+      addPrototype(S, S.Decls->NextItemSeq++, std::move(P));
+   S.Decls->NextCommitItem = S.Decls->NextItemSeq;
+   return true;
+}
+
+// Read the prelude like any input, except that with a snapshot to write
+// definitions are compiled to objects right away rather than on first call.
+static void compilePrelude(CompilerSession &S, StringRef Source,
+                           PreludeSnapshotData *Snapshot) {
+   FILE *SavedInput = Input;
+   FILE *F = fmemopen((void *)Source.data(), Source.size(), "r");
+   setLexerInput(F);
+   ReadingPrelude = true;
+   getNextToken();
+   while (auto Item = ParseItem(S)) {
+      CompileItem(S, *Item);
+      switch (Item->Kind) {
+         case TopLevelItem::Definition: {
+            if (!Snapshot || !Item->TSM.getModuleUnlocked()) {
+               CommitItem(S, *Item);
+               break;
+            }
+            std::unique_ptr<MemoryBuffer> Obj;
+            Item->TSM.withModuleDo([&](Module &M) {
+               M.getFunction(Item->Name)->setName(
+                       KaleidoscopeJIT::getBodyName(Item->Name));
+               Obj = ExitOnErr(SimpleCompiler(*S.TheTM)(M));
+            });
+            recordIRUsage(Item->Name, Item->IR);
+            if (auto Err = S.TheJIT->addDefinitionObject(
+                        Item->Name, MemoryBuffer::getMemBufferCopy(
+                                            Obj->getBuffer(), Item->Name))) {
+               logAllUnhandledErrors(std::move(Err), errs(), "LogError: ");
+               removePrototype(S, Item->Seq, Item->Name);
+            } else {
+               recordDependencies(*Item);
+               Snapshot->Protos.push_back(Item->FnAST->getProto());
+               Snapshot->Objects.push_back({Item->Name, std::move(Obj)});
+            }
+            S.Decls->NextCommitItem = Item->Seq + 1;
+            break;
+         }
+         case TopLevelItem::Extern:
+            if (Snapshot)
+               Snapshot->Protos.push_back(Item->Proto);
+            CommitItem(S, *Item);
+            break;
+         default:
+            LogError("Only definitions and externs belong in the prelude");
+            S.Decls->NextCommitItem = Item->Seq + 1;
+            break;
+      }
+   }
+   ReadingPrelude = false;
+   fclose(F);
+   setLexerInput(SavedInput);
+}
+
+Function *getFunction(CompilerSession &S, std::string Name) {
+    // First, see if the function has already been added to the current module.
+    if (auto *F = S.TheModule->getFunction(Name))
+        return F;
+
+    // If not, check whether we can codegen the declaration from some existing
+    // prototype.
+    if (auto Proto = findPrototype(S, Name))
+        return Proto->codegen(S);
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+
+// Benchmarks include this file for its internals and bring their own main().
+#ifndef MYLANG_NO_MAIN
+int main(int argc, char **argv) {
+   Startup.Start = std::chrono::steady_clock::now();
+   cl::ParseCommandLineOptions(argc, argv, "my-lang JIT\n");
+   phase_stats::printAtExitIfRequested();
+   CompilerSession S;
+   beginThreadTrace();
+   CountEvaluations = PerfCountersOpt;
+   if (ProfileOpt) {
+      Profiler = new SamplingProfiler();
+      if (!Profiler->start(ProfileInterval)) {
+         fprintf(stderr, "-profile is not supported on this platform\n");
+         return 1;
+      }
+      par_runtime::Scheduler::get().setThreadHooks(beginSampledThread,
+                                                   endSampledThread);
+   }
+
+   std::vector<UnitFile> UnitFiles;
+   if (InputFilenames.size() > 1 ||
+       (InputFilenames.size() == 1 && sys::fs::is_directory(InputFilenames[0])))
+      for (auto &Path : InputFilenames)
+         addUnitInputs(Path, UnitFiles);
+   bool Unit = !UnitFiles.empty();
+   std::string InputFilename =
+           InputFilenames.empty() || Unit ? "-" : InputFilenames[0];
+   if (Unit && (Watch || Pipeline)) {
+      fprintf(stderr, "-watch and -pipeline take a single input file\n");
+      return 1;
+   }
+   // Both move or drop compiled code, which needs nothing JIT'd running.
+   if (AsyncWorkers && (JITCodeBudget || JITHotZone)) {
+      fprintf(stderr,
+              "-async-workers can't be combined with -jit-code-budget or "
+              "-jit-hot-zone\n");
+      return 1;
+   }
+   if (Watch && InputFilename == "-") {
+      fprintf(stderr, "-watch needs an input file\n");
+      return 1;
+   }
+   if (InputFilename != "-" && !(Input = fopen(InputFilename.c_str(), "r"))) {
+      fprintf(stderr, "Cannot open %s\n", InputFilename.c_str());
+      return 1;
+   }
+
+   // Target setup and JIT construction don't need the input: run them
+   // while this thread maps the prelude snapshot and reads the first item.
+   std::thread StartupThread([&S] {
+      beginThreadTrace();
+      {
+         TimeTraceScope Scope("initialize targets");
+         InitializeNativeTarget();
+         InitializeNativeTargetAsmPrinter();
+         InitializeNativeTargetAsmParser();
+      }
+      Startup.TargetsReady = Startup.now();
+
+      {
+         TimeTraceScope Scope("create JIT");
+         S.TheJIT = ExitOnErr(KaleidoscopeJIT::Create(
+                 OptProfile != OptSpeed || JITHotZone, JITHotZone));
+      }
+      if (Profiler)
+         S.TheJIT->registerJITEventListener(*Profiler);
+      auto &JIT = *S.TheJIT;
+      JIT.getMemoryAccounting().setLimits(JITMemSoftLimit, JITMemHardLimit);
+      JIT.setCodeBudget(JITCodeBudget);
+      JIT.setHotLayout(JITHotZone ? JITHotCalls : 0);
+      JIT.startSpeculation(SpeculateDepth, SpeculateThreads, SpeculateIdle);
+      par_runtime::Scheduler::get().configure(ParWorkers, ParCutoff);
+      if (JITCodeBudget)
+         JIT.setSoftLimitHandler([&JIT] {
+            ExitOnErr(JIT.evictColdDefinitions(JITMemSoftLimit));
+         });
+      Startup.JITReady = Startup.now();
+      endThreadTrace();
+   });
+
+   std::string PreludeSource;
+   uint64_t SnapshotKey = 0;
+   std::vector<PreludeObject> SnapshotObjects;
+   bool SnapshotMapped = false;
+   if (!PreludeFilename.empty()) {
+      auto Buf = MemoryBuffer::getFile(PreludeFilename);
+      if (!Buf) {
+         fprintf(stderr, "Cannot open %s\n", PreludeFilename.c_str());
+         return 1;
+      }
+      PreludeSource = (*Buf)->getBuffer().str();
+      if (usePreludeSnapshot()) {
+         SnapshotKey = preludeSnapshotKey(PreludeSource);
+         SnapshotMapped = mapPreludeSnapshot(S, PreludeSnapshot, SnapshotKey,
+                                             SnapshotObjects);
+      } else if (!PreludeSnapshot.empty())
+         fprintf(stderr, "-prelude-snapshot is ignored with -jit-code-budget "
+                         "or -jit-hot-zone\n");
+   }
+
+   // Prime the first token, and read the first item too unless the
+   // prelude source has to be compiled before it.
+   bool CompilePreludeSource = !PreludeFilename.empty() && !SnapshotMapped;
+   std::unique_ptr<TopLevelItem> First;
+   if (!CompilePreludeSource && !Watch && !Unit) {
+      PrintPrompt();
+      getNextToken();
+      if (!Pipeline)
+         First = ParseItem(S);
+   }
+
+   StartupThread.join();
+   InitializeModulePassManager(S);
+
+   if (SnapshotMapped) {
+      for (auto &O : SnapshotObjects)
+         ExitOnErr(S.TheJIT->addDefinitionObject(O.Name, std::move(O.Object)));
+      Startup.Prelude = "snapshot";
+   } else if (CompilePreludeSource) {
+      PreludeSnapshotData Data;
+      compilePrelude(S, PreludeSource, usePreludeSnapshot() ? &Data : nullptr);
+      if (usePreludeSnapshot()) {
+         writePreludeSnapshot(PreludeSnapshot, SnapshotKey, Data);
+         Startup.Prelude = "source, snapshot written";
+      } else
+         Startup.Prelude = "source";
+      if (!Watch && !Unit) {
+         PrintPrompt();
+         getNextToken();
+      }
+   }
+   Startup.PreludeReady = Startup.now();
+   if (AsyncWorkers)
+      AsyncExecutor = std::make_unique<async_eval::Executor>(
+              AsyncWorkers,
+              [] {
+                 beginThreadTrace();
+                 beginSampledThread();
+              },
+              [] {
+                 endSampledThread();
+                 endThreadTrace();
+              });
+
+   // Run the main "interpreter loop" now.
+   if (Watch)
+      WatchLoop(S, InputFilename);
+   if (Unit)
+      UnitMainLoop(S, UnitFiles);
+   else if (Pipeline)
+      PipelinedMainLoop(S);
+   else
+      MainLoop(S, std::move(First));
+   drainResults(~0u);
+   AsyncExecutor.reset();
+   if (!Batch)
+      S.TheModule->print(errs(),nullptr);
+   if (Profiler) {
+      Profiler->stop();
+      Profiler->print(errs());
+   }
+   if (timeTraceProfilerEnabled()) {
+      if (auto Err = timeTraceProfilerWrite(TraceFilename, "llvm_first_lang"))
+         logAllUnhandledErrors(std::move(Err), errs(), "LogError: ");
+      timeTraceProfilerCleanup();
+   }
+   if (StartupStats)
+      fprintf(stderr,
+              "startup (ms since main): targets %.2f, jit %.2f, prelude "
+              "%.2f (%s), first result %.2f, exit %.2f\n",
+              Startup.TargetsReady, Startup.JITReady, Startup.PreludeReady,
+              Startup.Prelude, Startup.FirstResult, Startup.now());
+   return 0;
+}
+#endif // MYLANG_NO_MAIN
@@ -0,0 +1,273 @@
+//===- WorkloadGen.h - Synthetic my-lang programs ---------------*- C++ -*-===//
+//
+// Generates valid programs of a configurable shape for scaling tests. The
+// output depends on nothing but the shape and its seed: the generator has
+// its own PRNG and never uses the standard library's distributions, whose
+// results differ between implementations.
+//
+// Programs are a sequence of definitions interleaved with top-level
+// expressions. Definitions only call functions defined before them, plus
+// themselves when recursive. The language has no conditionals, so recursion
+// is bounded by a reduction over a shrinking first argument:
+//
+//   def f(n x) <expr> + sum k = 0, n - 1 in f(k, x) * 0.5;
+//
+// and recursive functions are always called with a small literal n. In
+// tutorial mode (Tutorial), for the toy.cpp front end, which has no
+// reductions, there are no recursive definitions at all. Calls
+// are only emitted while the estimated number of calls made by evaluating
+// the caller stays under MaxEvalCalls, so every generated expression
+// terminates quickly whatever the shape.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef MYLANG_WORKLOADGEN_H
+#define MYLANG_WORKLOADGEN_H
+
+#include <algorithm>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+
+struct WorkloadShape {
+  unsigned Definitions = 100;
+  unsigned MaxParams = 3;       // per definition, at least 1
+  unsigned Depth = 4;           // maximum expression nesting
+  unsigned Width = 3;           // maximum operands per operator chain
+  unsigned FanOut = 2;          // maximum call sites per definition
+  double Recursion = 0.1;       // fraction of self-recursive definitions
+  double Literals = 0.3;        // fraction of leaves that are literals
+  unsigned IdentMinLen = 1;     // identifier lengths are uniform in
+  unsigned IdentMaxLen = 8;     //   [IdentMinLen, IdentMaxLen]
+  double Expressions = 0.2;     // fraction of top-level items
+  uint64_t MaxEvalCalls = 1000; // per definition or expression
+  bool Tutorial = false;        // only what toy.cpp parses: no reductions
+  uint64_t Seed = 1;
+};
+
+/// splitmix64; the same sequence on every platform.
+class WorkloadRNG {
+  uint64_t State;
+
+public:
+  explicit WorkloadRNG(uint64_t Seed) : State(Seed) {}
+
+  uint64_t next() {
+    uint64_t Z = (State += 0x9e3779b97f4a7c15ULL);
+    Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    Z = (Z ^ (Z >> 27)) * 0x94d049bb133111ebULL;
+    return Z ^ (Z >> 31);
+  }
+
+  /// Uniform in [Lo, Hi].
+  unsigned range(unsigned Lo, unsigned Hi) {
+    return Lo + next() % (uint64_t(Hi) - Lo + 1);
+  }
+
+  /// True with probability P.
+  bool chance(double P) {
+    return (next() >> 11) * (1.0 / 9007199254740992.0) < P;
+  }
+};
+
+class WorkloadGenerator {
+  // Recursive functions are called with n in [0, MaxRecursionArg];
+  // f(n) makes Fib(n)-like many calls, 13 for n = 6.
+  static constexpr unsigned MaxRecursionArg = 6;
+  static constexpr uint64_t RecursionCalls = 13;
+
+  struct Fn {
+    std::string Name;
+    std::vector<std::string> Params;
+    bool Recursive;
+    uint64_t Cost; // calls made by one evaluation, itself included
+  };
+
+  WorkloadShape Shape;
+  WorkloadRNG RNG;
+  std::vector<Fn> Fns;
+  std::set<std::string> FnNames;
+
+  // The definition or expression being generated.
+  const std::vector<std::string> *Params = nullptr;
+  unsigned CallsLeft = 0;
+  uint64_t Cost = 0;
+
+  static bool isReserved(const std::string &S) {
+    // Keywords, and libm names LLVM would treat as library calls.
+    static const char *const Reserved[] = {
+        "def",   "extern", "in",    "sum",   "min",   "max",   "count",
+        "dot",   "var",    "sin",   "cos",   "tan",   "asin",  "acos",
+        "atan",  "atan2",  "sinh",  "cosh",  "tanh",  "exp",   "exp2",
+        "expm1", "log",    "log2",  "log10", "log1p", "pow",   "sqrt",
+        "cbrt",  "fabs",   "floor", "ceil",  "round", "trunc", "rint",
+        "fmod",  "fmin",   "fmax",  "hypot", "ldexp", "erf",   "nearbyint",
+        "copysign"};
+    for (const char *R : Reserved)
+      if (S == R)
+        return true;
+    return false;
+  }
+
+  std::string identifier(std::set<std::string> &Used) {
+    static const char Alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    unsigned Len = RNG.range(Shape.IdentMinLen, Shape.IdentMaxLen);
+    for (unsigned Try = 0;; ++Try) {
+      std::string S(1, Alnum[RNG.range(0, 25)]);
+      while (S.size() < Len)
+        S += Alnum[RNG.range(0, 35)];
+      // Short lengths run out of names; stretch them rather than loop.
+      if (Try >= 8)
+        S += std::to_string(Try);
+      if (!isReserved(S) && Used.insert(S).second)
+        return S;
+    }
+  }
+
+  std::string literal() {
+    std::string S = std::to_string(RNG.range(0, 9));
+    if (RNG.chance(0.5))
+      S += "." + std::to_string(RNG.range(0, 9));
+    return S;
+  }
+
+  std::string leaf() {
+    if (Params->empty() || RNG.chance(Shape.Literals))
+      return literal();
+    return (*Params)[RNG.range(0, Params->size() - 1)];
+  }
+
+  // A call to an earlier function, if one fits the remaining budget.
+  bool call(unsigned Depth, std::string &Out) {
+    if (!CallsLeft || Fns.empty())
+      return false;
+    for (int Try = 0; Try < 4; ++Try) {
+      const Fn &Callee = Fns[RNG.range(0, Fns.size() - 1)];
+      if (Cost + Callee.Cost > Shape.MaxEvalCalls)
+        continue;
+      --CallsLeft;
+      Cost += Callee.Cost;
+      Out = Callee.Name + "(";
+      for (size_t I = 0; I < Callee.Params.size(); ++I) {
+        if (I)
+          Out += ", ";
+        if (I == 0 && Callee.Recursive)
+          Out += std::to_string(RNG.range(0, MaxRecursionArg));
+        else
+          Out += Depth ? expr(Depth - 1) : leaf();
+      }
+      Out += ")";
+      return true;
+    }
+    return false;
+  }
+
+  std::string operand(unsigned Depth) {
+    std::string Call;
+    if (RNG.chance(0.3) && call(Depth, Call))
+      return Call;
+    if (Depth && RNG.chance(0.5)) {
+      bool Chain;
+      std::string Sub = expr(Depth - 1, Chain);
+      return Chain ? "(" + Sub + ")" : Sub;
+    }
+    return leaf();
+  }
+
+  // Sets Chain when the result is an operator chain rather than a single
+  // operand, i.e. needs parentheses to be used as one.
+  std::string expr(unsigned Depth, bool &Chain) {
+    static const char *const Ops[] = {" + ", " - ", " * ", " < "};
+    std::string S = operand(Depth);
+    unsigned N = Depth ? RNG.range(1, std::max(2u, Shape.Width)) : 1;
+    for (unsigned I = 1; I < N; ++I)
+      S += Ops[RNG.range(0, 3)] + operand(Depth);
+    Chain = N > 1;
+    return S;
+  }
+
+  std::string expr(unsigned Depth) {
+    bool Chain;
+    return expr(Depth, Chain);
+  }
+
+  std::string definition() {
+    Fn F;
+    F.Name = identifier(FnNames);
+    F.Recursive = !Shape.Tutorial && RNG.chance(Shape.Recursion);
+    // At least one parameter: the parser cannot read empty argument lists.
+    std::set<std::string> Used;
+    unsigned NumParams = RNG.range(1, std::max(1u, Shape.MaxParams));
+    for (unsigned I = 0; I < NumParams; ++I)
+      F.Params.push_back(identifier(Used));
+
+    // A recursive body runs up to RecursionCalls times per outside call.
+    Params = &F.Params;
+    CallsLeft = Shape.FanOut;
+    Cost = 0;
+    uint64_t SavedMax = Shape.MaxEvalCalls;
+    if (F.Recursive)
+      Shape.MaxEvalCalls /= RecursionCalls;
+    std::string Body = expr(Shape.Depth);
+    Shape.MaxEvalCalls = SavedMax;
+
+    std::string S = "def " + F.Name + "(";
+    for (size_t I = 0; I < F.Params.size(); ++I)
+      S += (I ? " " : "") + F.Params[I];
+    S += ") " + Body;
+    if (F.Recursive) {
+      std::string K = identifier(Used);
+      S += " + sum " + K + " = 0, " + F.Params[0] + " - 1 in " + F.Name +
+           "(" + K;
+      for (size_t I = 1; I < F.Params.size(); ++I)
+        S += ", " + F.Params[I];
+      S += ") * 0.5";
+      F.Cost = RecursionCalls * (1 + Cost);
+    } else
+      F.Cost = 1 + Cost;
+    Fns.push_back(std::move(F));
+    return S + ";\n";
+  }
+
+  std::string expression() {
+    static const std::vector<std::string> NoParams;
+    Params = &NoParams;
+    CallsLeft = std::max(1u, Shape.FanOut);
+    Cost = 0;
+    std::string S;
+    if (!call(Shape.Depth, S))
+      S = expr(Shape.Depth);
+    return S + ";\n";
+  }
+
+public:
+  explicit WorkloadGenerator(const WorkloadShape &Shape)
+      : Shape(Shape), RNG(Shape.Seed) {
+    this->Shape.IdentMinLen = std::max(1u, Shape.IdentMinLen);
+    this->Shape.IdentMaxLen =
+        std::max(this->Shape.IdentMinLen, Shape.IdentMaxLen);
+  }
+
+  std::string generate() {
+    std::string Out;
+    double ExprRatio = std::min(Shape.Expressions, 0.99);
+    unsigned Defs = 0;
+    while (Defs < Shape.Definitions) {
+      if (!Fns.empty() && RNG.chance(ExprRatio)) {
+        Out += expression();
+      } else {
+        Out += definition();
+        ++Defs;
+      }
+    }
+    return Out;
+  }
+};
+
+/// The program of the given shape and seed.
+inline std::string generateWorkload(const WorkloadShape &Shape) {
+  return WorkloadGenerator(Shape).generate();
+}
+
+#endif // MYLANG_WORKLOADGEN_H
@@ -0,0 +1,271 @@
+//
+// mylang_diff - run the same programs through toy.cpp and my-lang.cpp.
+//
+// Usage: mylang_diff [-runs=N] [-gen-defs=N] [-mylang-arg=...] [inputs...]
+//
+// Every input is fed on stdin to both front ends, -runs times each. The
+// default inputs are the corpus plus a workload from WorkloadGen.h in
+// tutorial mode. Per front end it reports the best wall time, the
+// compile/evaluate split (PhaseStats.h), the optimized IR size of the
+// definitions, and peak RSS; then every top-level result the two disagree
+// on, and any errors. The toy front end only knows the tutorial language,
+// so inputs using my-lang extensions show up as errors, not divergences;
+// corpus/tutorial.k and the generated workload are the ones both run.
+// toy.cpp is built against the tutorial's own KaleidoscopeJIT.h (toy/), so
+// the comparison covers our JIT changes as well as the front end's. Run it
+// before and after a change to my-lang.cpp to see what the change did to
+// performance, and whether results moved.
+//
+#include "WorkloadGen.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern char **environ;
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional,
+                                    cl::desc("<input files>"));
+static cl::opt<std::string> ToyPath(
+        "toy", cl::init(MYLANG_TOY_PATH),
+        cl::desc("toy.cpp front end executable"));
+static cl::opt<std::string> MyLangPath(
+        "mylang", cl::init(MYLANG_PATH),
+        cl::desc("my-lang.cpp front end executable"));
+static cl::list<std::string> MyLangArgs(
+        "mylang-arg", cl::desc("Extra argument for the my-lang front end"));
+static cl::opt<unsigned> Runs("runs", cl::init(3),
+                              cl::desc("Runs per input and front end; the "
+                                       "fastest is reported"));
+static cl::opt<unsigned> GenDefs(
+        "gen-defs", cl::init(300),
+        cl::desc("Definitions in the generated tutorial-language workload "
+                 "run with the corpus (0: none)"));
+
+struct RunResult {
+   bool Ran = false;
+   int Status = 0;
+   double WallMs = 0, CompileMs = 0, EvalMs = 0;
+   uint64_t PeakKB = 0;
+   unsigned IRInsts = 0;                // in optimized definitions
+   std::vector<std::string> Results;    // "Evaluated to" values, in order
+   std::vector<std::string> Errors;
+};
+
+// Pull results, errors, IR size and the phase split out of a run's stderr.
+static void parseOutput(StringRef Out, RunResult &R) {
+   bool InDefinition = false, InBody = false;
+   SmallVector<StringRef, 0> Lines;
+   Out.split(Lines, '\n');
+   for (StringRef Line : Lines) {
+      // Both front ends print a header before each IR dump, and the dump
+      // follows on the same or the next lines.
+      if (Line.contains("Read function definition"))
+         InDefinition = true;
+      else if (Line.contains("Read top-level expression") ||
+               Line.contains("Read extern"))
+         InDefinition = false;
+      if (Line.contains("define ")) {
+         InBody = InDefinition;
+         continue;
+      }
+      if (InBody) {
+         if (Line.startswith("}"))
+            InBody = false;
+         else if (Line.startswith("  "))
+            ++R.IRInsts;
+         continue;
+      }
+
+      StringRef Value;
+      unsigned long long Compile, Eval;
+      if (Line.contains("Evaluated to ")) {
+         Value = Line.split("Evaluated to ").second.trim();
+         R.Results.push_back(Value.str());
+      } else if (sscanf(Line.str().c_str(),
+                        "phase-stats: compile-ns=%llu eval-ns=%llu", &Compile,
+                        &Eval) == 2) {
+         R.CompileMs = Compile / 1e6;
+         R.EvalMs = Eval / 1e6;
+      } else if (Line.contains("Error") || Line.contains("error:")) {
+         // The toy front end prints its prompts without newlines.
+         while (Line.consume_front("ready> "))
+            ;
+         R.Errors.push_back(Line.trim().str());
+      }
+   }
+}
+
+static RunResult runOnce(StringRef Program, ArrayRef<std::string> ExtraArgs,
+                         StringRef Input) {
+   RunResult R;
+   SmallString<128> OutFile;
+   if (sys::fs::createTemporaryFile("mylang_diff", "err", OutFile)) {
+      R.Errors.push_back("cannot create a temporary file");
+      return R;
+   }
+
+   std::vector<StringRef> Args = {Program};
+   for (auto &A : ExtraArgs)
+      Args.push_back(A);
+   std::vector<StringRef> Env;
+   for (char **E = environ; *E; ++E)
+      Env.push_back(*E);
+   Env.push_back("MYLANG_PHASE_STATS=1");
+   Optional<StringRef> Redirects[] = {Input, StringRef(""), StringRef(OutFile)};
+
+   std::string ErrMsg;
+   bool Failed = false;
+   Optional<sys::ProcessStatistics> Stats;
+   auto T0 = std::chrono::steady_clock::now();
+   R.Status = sys::ExecuteAndWait(Program, Args, makeArrayRef(Env), Redirects,
+                                  0, 0, &ErrMsg, &Failed, &Stats);
+   auto T1 = std::chrono::steady_clock::now();
+   if (Failed) {
+      R.Errors.push_back(ErrMsg);
+      sys::fs::remove(OutFile);
+      return R;
+   }
+   R.Ran = true;
+   R.WallMs = std::chrono::duration<double, std::milli>(T1 - T0).count();
+   if (Stats)
+      R.PeakKB = Stats->PeakMemory;
+   if (auto Buf = MemoryBuffer::getFile(OutFile))
+      parseOutput((*Buf)->getBuffer(), R);
+   sys::fs::remove(OutFile);
+   return R;
+}
+
+// Best wall time of Runs runs; memory and output come from the same run.
+static RunResult run(StringRef Program, ArrayRef<std::string> ExtraArgs,
+                     StringRef Input) {
+   RunResult Best;
+   for (unsigned I = 0; I < std::max(1u, (unsigned)Runs); ++I) {
+      RunResult R = runOnce(Program, ExtraArgs, Input);
+      if (!R.Ran)
+         return R;
+      if (!Best.Ran || R.WallMs < Best.WallMs)
+         Best = std::move(R);
+   }
+   return Best;
+}
+
+static void printRow(const char *Name, const RunResult &R) {
+   if (!R.Ran) {
+      printf("  %-8s did not run: %s\n", Name,
+             R.Errors.empty() ? "" : R.Errors[0].c_str());
+      return;
+   }
+   printf("  %-8s %10.2f %10.2f %10.2f %9u %9llu %7zu", Name, R.WallMs,
+          R.CompileMs, R.EvalMs, R.IRInsts, (unsigned long long)R.PeakKB,
+          R.Results.size());
+   if (R.Status)
+      printf("  exit status %d", R.Status);
+   printf("\n");
+}
+
+// The first few errors; one mistake tends to cascade in the toy parser.
+static void printErrors(const char *Name, const RunResult &R) {
+   const size_t Shown = 3;
+   for (size_t I = 0; I < R.Errors.size() && I < Shown; ++I)
+      printf("  %s: %s\n", Name, R.Errors[I].c_str());
+   if (R.Errors.size() > Shown)
+      printf("  %s: ... %zu more errors\n", Name, R.Errors.size() - Shown);
+}
+
+static double ratio(double New, double Old) { return Old ? New / Old : 0; }
+
+int main(int argc, char **argv) {
+   cl::ParseCommandLineOptions(argc, argv, "toy.cpp vs. my-lang.cpp\n");
+
+   std::vector<std::string> Files(Inputs.begin(), Inputs.end());
+   SmallString<128> Generated;
+   if (Files.empty()) {
+      std::error_code EC;
+      for (sys::fs::directory_iterator I(MYLANG_CORPUS_DIR, EC), E;
+           I != E && !EC; I.increment(EC))
+         if (StringRef(I->path()).endswith(".k"))
+            Files.push_back(I->path());
+      std::sort(Files.begin(), Files.end());
+
+      if (GenDefs) {
+         WorkloadShape Shape;
+         Shape.Definitions = GenDefs;
+         Shape.Tutorial = true;
+         int FD;
+         if (sys::fs::createTemporaryFile("mylang_diff_gen", "k", FD,
+                                          Generated)) {
+            fprintf(stderr, "cannot create a temporary file\n");
+            return 1;
+         }
+         std::string Program = generateWorkload(Shape);
+         FILE *Out = fdopen(FD, "w");
+         fwrite(Program.data(), 1, Program.size(), Out);
+         fclose(Out);
+         Files.push_back(Generated.str().str());
+      }
+   }
+
+   std::vector<std::string> ToyArgs;
+   unsigned Divergent = 0, NotCompared = 0;
+   for (auto &File : Files) {
+      RunResult Toy = run(ToyPath, ToyArgs, File);
+      RunResult MyLang = run(MyLangPath, MyLangArgs, File);
+
+      printf("%s\n", File.c_str());
+      printf("  %-8s %10s %10s %10s %9s %9s %7s\n", "", "wall ms",
+             "compile ms", "eval ms", "IR insts", "peak KB", "results");
+      printRow("toy", Toy);
+      printRow("my-lang", MyLang);
+      if (Toy.Ran && MyLang.Ran)
+         printf("  %-8s %9.2fx %9.2fx %9.2fx %8.2fx %8.2fx\n", "ratio",
+                ratio(MyLang.WallMs, Toy.WallMs),
+                ratio(MyLang.CompileMs, Toy.CompileMs),
+                ratio(MyLang.EvalMs, Toy.EvalMs),
+                ratio(MyLang.IRInsts, Toy.IRInsts),
+                ratio(MyLang.PeakKB, Toy.PeakKB));
+
+      // After an error the items the two front ends saw no longer line up,
+      // so results are only compared between clean runs.
+      bool Clean = Toy.Ran && MyLang.Ran && !Toy.Status && !MyLang.Status &&
+                   Toy.Errors.empty() && MyLang.Errors.empty();
+      if (Clean) {
+         size_t N = std::max(Toy.Results.size(), MyLang.Results.size());
+         for (size_t I = 0; I < N; ++I) {
+            const char *T = I < Toy.Results.size() ? Toy.Results[I].c_str()
+                                                   : "(none)";
+            const char *M = I < MyLang.Results.size()
+                                    ? MyLang.Results[I].c_str()
+                                    : "(none)";
+            if (strcmp(T, M)) {
+               printf("  result %zu differs: toy %s, my-lang %s\n", I + 1, T,
+                      M);
+               ++Divergent;
+            }
+         }
+      } else {
+         printf("  results not compared\n");
+         ++NotCompared;
+      }
+      printErrors("toy", Toy);
+      printErrors("my-lang", MyLang);
+   }
+   printf("%u divergent result%s", Divergent, Divergent == 1 ? "" : "s");
+   if (NotCompared)
+      printf(", %u input%s not compared", NotCompared,
+             NotCompared == 1 ? "" : "s");
+   printf("\n");
+   if (!Generated.empty())
+      sys::fs::remove(Generated);
+   return Divergent ? 1 : 0;
+}
@@ -0,0 +1,89 @@
+//
+// mylang_gen - synthetic workloads for scaling tests.
+//
+// Usage: mylang_gen [-seed=N] [-defs=N] [shape options] [-o file]
+//
+// The same options and seed give the same program on every machine, so
+// runs of llvm_first_lang or mylang_bench on it can be reproduced.
+//
+#include "WorkloadGen.h"
+#include "llvm/Support/CommandLine.h"
+#include <cstdio>
+
+using namespace llvm;
+
+static cl::opt<std::string> OutputFilename("o", cl::init("-"),
+                                           cl::desc("Output file"));
+static cl::opt<uint64_t> Seed("seed", cl::init(1), cl::desc("PRNG seed"));
+static cl::opt<unsigned> Definitions("defs", cl::init(100),
+                                     cl::desc("Number of definitions"));
+static cl::opt<unsigned> MaxParams("params", cl::init(3),
+                                   cl::desc("Maximum parameters per definition"));
+static cl::opt<unsigned> Depth("depth", cl::init(4),
+                               cl::desc("Maximum expression nesting"));
+static cl::opt<unsigned> Width("width", cl::init(3),
+                               cl::desc("Maximum operands per operator chain"));
+static cl::opt<unsigned> FanOut("fanout", cl::init(2),
+                                cl::desc("Maximum call sites per definition"));
+static cl::opt<double> Recursion(
+        "recursion", cl::init(0.1),
+        cl::desc("Fraction of definitions that are self-recursive"));
+static cl::opt<double> Literals(
+        "literals", cl::init(0.3),
+        cl::desc("Fraction of expression leaves that are literals"));
+static cl::opt<unsigned> IdentMinLen("ident-min", cl::init(1),
+                                     cl::desc("Minimum identifier length"));
+static cl::opt<unsigned> IdentMaxLen("ident-max", cl::init(8),
+                                     cl::desc("Maximum identifier length"));
+static cl::opt<double> Expressions(
+        "exprs", cl::init(0.2),
+        cl::desc("Fraction of top-level items that are expressions"));
+static cl::opt<uint64_t> MaxEvalCalls(
+        "max-eval-calls", cl::init(1000),
+        cl::desc("Bound on the calls one definition or expression makes"));
+static cl::opt<bool> Tutorial(
+        "toy", cl::init(false),
+        cl::desc("Only the tutorial language toy.cpp parses (no reductions, "
+                 "so no recursion)"));
+
+int main(int argc, char **argv) {
+   cl::ParseCommandLineOptions(argc, argv, "my-lang workload generator\n");
+
+   WorkloadShape Shape;
+   Shape.Seed = Seed;
+   Shape.Definitions = Definitions;
+   Shape.MaxParams = MaxParams;
+   Shape.Depth = Depth;
+   Shape.Width = Width;
+   Shape.FanOut = FanOut;
+   Shape.Recursion = Recursion;
+   Shape.Literals = Literals;
+   Shape.IdentMinLen = IdentMinLen;
+   Shape.IdentMaxLen = IdentMaxLen;
+   Shape.Expressions = Expressions;
+   Shape.MaxEvalCalls = MaxEvalCalls;
+   Shape.Tutorial = Tutorial;
+
+   FILE *Out = stdout;
+   if (OutputFilename != "-" && !(Out = fopen(OutputFilename.c_str(), "w"))) {
+      fprintf(stderr, "Cannot open %s\n", OutputFilename.c_str());
+      return 1;
+   }
+
+   // Record the full shape, so the program can be made again.
+   fprintf(Out,
+           "# mylang_gen -seed=%llu -defs=%u -params=%u -depth=%u -width=%u "
+           "-fanout=%u -recursion=%g -literals=%g -ident-min=%u -ident-max=%u "
+           "-exprs=%g -max-eval-calls=%llu%s\n",
+           (unsigned long long)Shape.Seed, Shape.Definitions, Shape.MaxParams,
+           Shape.Depth, Shape.Width, Shape.FanOut, Shape.Recursion,
+           Shape.Literals, Shape.IdentMinLen, Shape.IdentMaxLen,
+           Shape.Expressions, (unsigned long long)Shape.MaxEvalCalls,
+           Shape.Tutorial ? " -toy" : "");
+
+   std::string Program = generateWorkload(Shape);
+   fwrite(Program.data(), 1, Program.size(), Out);
+   if (Out != stdout)
+      fclose(Out);
+   return 0;
+}
@@ -1,4 +1,5 @@
-#include "KaleidoscopeJIT.h"
+#include "toy/KaleidoscopeJIT.h"
+#include "PhaseStats.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
@@ -575,7 +576,12 @@ static void InitializeModuleAndPassManager() {
 
 static void HandleDefinition() {
   if (auto FnAST = ParseDefinition()) {
-    if (auto *FnIR = FnAST->codegen()) {
+    Function *FnIR;
+    {
+      phase_stats::CompileTimer Timer;
+      FnIR = FnAST->codegen();
+    }
+    if (FnIR) {
       fprintf(stderr, "Read function definition:");
       FnIR->print(errs());
       fprintf(stderr, "\n");
@@ -606,7 +612,12 @@ static void HandleExtern() {
 static void HandleTopLevelExpression() {
   // Evaluate a top-level expression into an anonymous function.
   if (auto FnAST = ParseTopLevelExpr()) {
-    if (FnAST->codegen()) {
+    Function *FnIR;
+    {
+      phase_stats::CompileTimer Timer;
+      FnIR = FnAST->codegen();
+    }
+    if (FnIR) {
       // Create a ResourceTracker to track JIT'd memory allocated to our
       // anonymous expression -- that way we can free it after executing.
       auto RT = TheJIT->getMainJITDylib().createResourceTracker();
@@ -621,7 +632,12 @@ static void HandleTopLevelExpression() {
       // Get the symbol's address and cast it to the right type (takes no
       // arguments, returns a double) so we can call it as a native function.
       double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-      fprintf(stderr, "Evaluated to %f\n", FP());
+      double Result;
+      {
+        phase_stats::EvalTimer Timer;
+        Result = FP();
+      }
+      fprintf(stderr, "Evaluated to %f\n", Result);
 
       // Delete the anonymous expression module from the JIT.
       ExitOnErr(RT->remove());
@@ -682,6 +698,8 @@ extern "C" DLLEXPORT double printd(double X) {
 //===----------------------------------------------------------------------===//
 
 int main() {
+  phase_stats::printAtExitIfRequested();
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();